@@ -0,0 +1,515 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <janet.h>
+#include "hermes.h"
+
+/* Package archives made and unpacked on a thread of our own, streaming
+   through a file descriptor, instead of in a hermes-minitar process.
+
+   The thread owns a duplicate of the descriptor and closes it when it
+   is done, so a reader on the other end of a pipe sees end of file as
+   it would with a process. Closing a job cancels it and waits for the
+   thread, so whoever feeds or drains the pipe must close their end
+   first. */
+
+#define ARCHIVE_BUF_SIZE (256 * 1024)
+
+typedef struct {
+    int refs;
+    int cancel;
+    int fd;
+    struct archive *a;
+    char *dir;
+    int failed;
+    char err[512];
+} ArchiveJob;
+
+typedef struct {
+    ArchiveJob *job;
+    pthread_t thread;
+    int running;
+} ArchiveHandle;
+
+static void job_release(ArchiveJob *job) {
+    if (__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    free(job->dir);
+    free(job);
+}
+
+static int job_cancelled(ArchiveJob *job) {
+    return __atomic_load_n(&job->cancel, __ATOMIC_ACQUIRE);
+}
+
+static void job_fail(ArchiveJob *job, const char *what, const char *detail) {
+    if (job->failed)
+        return;
+    job->failed = 1;
+    snprintf(job->err, sizeof(job->err), "%s - %s", what, detail ? detail : "unknown error");
+}
+
+static void job_fail_archive(ArchiveJob *job, const char *what, struct archive *a) {
+    char msg[256];
+    const char *s = archive_error_string(a);
+    int e = archive_errno(a);
+    /* libarchive reports bad input and misuse as EILSEQ and EINVAL, the
+       message says more than those would. */
+    if (s && e > 0 && e != EILSEQ && e != EINVAL && strstr(s, strerror(e)) == NULL)
+        snprintf(msg, sizeof(msg), "%s: %s", s, strerror(e));
+    else
+        snprintf(msg, sizeof(msg), "%s", s ? s : e > 0 ? strerror(e) : "unknown error");
+    job_fail(job, what, msg);
+}
+
+static int copy_file_data(ArchiveJob *job, struct archive *a, const char *path, char *buf) {
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        job_fail(job, path, strerror(errno));
+        return -1;
+    }
+    for (;;) {
+        if (job_cancelled(job)) {
+            job_fail(job, path, "cancelled");
+            break;
+        }
+        ssize_t n = read(fd, buf, ARCHIVE_BUF_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            job_fail(job, path, strerror(errno));
+            break;
+        }
+        if (n == 0) {
+            close(fd);
+            return 0;
+        }
+        if (archive_write_data(a, buf, n) < 0) {
+            job_fail_archive(job, "unable to write archive", a);
+            break;
+        }
+    }
+    close(fd);
+    return -1;
+}
+
+static void *create_main(void *p) {
+    ArchiveJob *job = p;
+    struct archive *a = job->a;
+    struct archive *disk = archive_read_disk_new();
+    struct archive_entry *entry = archive_entry_new();
+    char *buf = malloc(ARCHIVE_BUF_SIZE);
+    char path[PATH_MAX];
+    size_t dirlen = strlen(job->dir);
+
+    if (!disk || !entry || !buf) {
+        job_fail(job, "unable to create archive", strerror(ENOMEM));
+        goto out;
+    }
+    archive_read_disk_set_symlink_physical(disk);
+    archive_read_disk_set_standard_lookup(disk);
+
+    if (archive_write_open_fd(a, job->fd) != ARCHIVE_OK) {
+        job_fail_archive(job, "unable to write archive", a);
+        goto out;
+    }
+    if (archive_read_disk_open(disk, job->dir) != ARCHIVE_OK) {
+        job_fail_archive(job, "unable to archive", disk);
+        goto out;
+    }
+
+    for (;;) {
+        if (job_cancelled(job)) {
+            job_fail(job, job->dir, "cancelled");
+            break;
+        }
+        archive_entry_clear(entry);
+        int r = archive_read_next_header2(disk, entry);
+        if (r == ARCHIVE_EOF)
+            break;
+        if (r != ARCHIVE_OK) {
+            job_fail_archive(job, "unable to archive", disk);
+            break;
+        }
+        archive_read_disk_descend(disk);
+
+        /* Name entries relative to dir, as if archiving . from inside it. */
+        const char *name = archive_entry_pathname(entry) + dirlen;
+        if (snprintf(path, sizeof(path), ".%s", name) >= (int)sizeof(path)) {
+            job_fail(job, archive_entry_sourcepath(entry), "path too long");
+            break;
+        }
+        archive_entry_set_pathname(entry, path);
+
+        if (archive_write_header(a, entry) < ARCHIVE_WARN) {
+            job_fail_archive(job, archive_entry_sourcepath(entry), a);
+            break;
+        }
+        if (archive_entry_filetype(entry) == AE_IFREG && archive_entry_size(entry) > 0)
+            if (copy_file_data(job, a, archive_entry_sourcepath(entry), buf) != 0)
+                break;
+    }
+
+    if (archive_write_close(a) != ARCHIVE_OK)
+        job_fail_archive(job, "unable to write archive", a);
+
+out:
+    if (disk)
+        archive_read_free(disk);
+    if (entry)
+        archive_entry_free(entry);
+    free(buf);
+    archive_write_free(a);
+    close(job->fd);
+    job_release(job);
+    return NULL;
+}
+
+/* Archive entries must stay inside the directory we unpack into. */
+static int safe_entry_path(const char *p) {
+    if (!p || *p == '/')
+        return 0;
+    for (const char *s = p; s; s = strchr(s, '/')) {
+        if (*s == '/')
+            s++;
+        if (s[0] == '.' && s[1] == '.' && (s[2] == '/' || s[2] == '\0'))
+            return 0;
+    }
+    return 1;
+}
+
+static int prefix_entry_path(ArchiveJob *job, char *out, const char *p) {
+    if (!safe_entry_path(p)) {
+        job_fail(job, "refusing to unpack entry outside the package", p);
+        return -1;
+    }
+    if (snprintf(out, PATH_MAX, "%s/%s", job->dir, p) >= PATH_MAX) {
+        job_fail(job, p, "path too long");
+        return -1;
+    }
+    return 0;
+}
+
+static void *extract_main(void *p) {
+    ArchiveJob *job = p;
+    struct archive *a = job->a;
+    struct archive *ext = archive_write_disk_new();
+    struct archive_entry *entry;
+    char path[PATH_MAX];
+    char link[PATH_MAX];
+
+    if (!ext) {
+        job_fail(job, "unable to unpack archive", strerror(ENOMEM));
+        goto out;
+    }
+    archive_write_disk_set_options(ext,
+        ARCHIVE_EXTRACT_TIME
+        | ARCHIVE_EXTRACT_SECURE_SYMLINKS
+        | ARCHIVE_EXTRACT_SECURE_NODOTDOT);
+    archive_write_disk_set_standard_lookup(ext);
+
+    if (archive_read_open_fd(a, job->fd, ARCHIVE_BUF_SIZE) != ARCHIVE_OK) {
+        job_fail_archive(job, "unable to read archive", a);
+        goto out;
+    }
+
+    for (;;) {
+        if (job_cancelled(job)) {
+            job_fail(job, job->dir, "cancelled");
+            break;
+        }
+        int r = archive_read_next_header(a, &entry);
+        if (r == ARCHIVE_EOF)
+            break;
+        if (r < ARCHIVE_WARN) {
+            job_fail_archive(job, "unable to read archive", a);
+            break;
+        }
+
+        if (prefix_entry_path(job, path, archive_entry_pathname(entry)) != 0)
+            break;
+        archive_entry_set_pathname(entry, path);
+        const char *hardlink = archive_entry_hardlink(entry);
+        if (hardlink) {
+            if (prefix_entry_path(job, link, hardlink) != 0)
+                break;
+            archive_entry_set_hardlink(entry, link);
+        }
+
+        if (archive_write_header(ext, entry) < ARCHIVE_WARN) {
+            job_fail_archive(job, path, ext);
+            break;
+        }
+        if (archive_entry_size(entry) > 0) {
+            const void *block;
+            size_t size;
+            int64_t offset;
+            while ((r = archive_read_data_block(a, &block, &size, &offset)) == ARCHIVE_OK) {
+                if (archive_write_data_block(ext, block, size, offset) < ARCHIVE_WARN) {
+                    job_fail_archive(job, path, ext);
+                    break;
+                }
+            }
+            if (job->failed)
+                break;
+            if (r != ARCHIVE_EOF) {
+                job_fail_archive(job, "unable to read archive", a);
+                break;
+            }
+        }
+        if (archive_write_finish_entry(ext) < ARCHIVE_WARN) {
+            job_fail_archive(job, path, ext);
+            break;
+        }
+    }
+
+    if (!job->failed && archive_write_close(ext) != ARCHIVE_OK)
+        job_fail_archive(job, job->dir, ext);
+
+out:
+    if (ext)
+        archive_write_free(ext);
+    archive_read_free(a);
+    close(job->fd);
+    job_release(job);
+    return NULL;
+}
+
+static int archive_handle_gc(void *p, size_t s) {
+    (void)s;
+    ArchiveHandle *h = p;
+    if (h->running) {
+        /* Nobody will wait for it now, let it finish on its own. */
+        __atomic_store_n(&h->job->cancel, 1, __ATOMIC_RELEASE);
+        pthread_detach(h->thread);
+        job_release(h->job);
+        h->running = 0;
+    }
+    return 0;
+}
+
+static int archive_handle_get(void *p, Janet key, Janet *out);
+
+const JanetAbstractType hermes_archive_job_type = {
+    "_hermes/archive-job",
+    archive_handle_gc,
+    NULL,
+    archive_handle_get,
+    JANET_ATEND_GET
+};
+
+static int archive_handle_join(ArchiveHandle *h) {
+    if (!h->running)
+        return 0;
+    pthread_join(h->thread, NULL);
+    h->running = 0;
+    int failed = h->job->failed;
+    return failed;
+}
+
+static Janet archive_job_wait(int argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    ArchiveHandle *h = janet_getabstract(argv, 0, &hermes_archive_job_type);
+    if (!h->job)
+        janet_panic("archive job already finished");
+    int failed = archive_handle_join(h);
+    ArchiveJob *job = h->job;
+    h->job = NULL;
+    if (failed) {
+        char err[sizeof(job->err)];
+        memcpy(err, job->err, sizeof(err));
+        job_release(job);
+        janet_panicf("%s", err);
+    }
+    job_release(job);
+    return janet_wrap_nil();
+}
+
+static Janet archive_job_close(int argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    ArchiveHandle *h = janet_getabstract(argv, 0, &hermes_archive_job_type);
+    if (h->job) {
+        __atomic_store_n(&h->job->cancel, 1, __ATOMIC_RELEASE);
+        archive_handle_join(h);
+        job_release(h->job);
+        h->job = NULL;
+    }
+    return janet_wrap_nil();
+}
+
+static JanetMethod archive_job_methods[] = {
+    {"wait", archive_job_wait},
+    {"close", archive_job_close},
+    {NULL, NULL}
+};
+
+static int archive_handle_get(void *p, Janet key, Janet *out) {
+    (void) p;
+    if (!janet_checktype(key, JANET_KEYWORD))
+        return 0;
+    return janet_getmethod(janet_unwrap_keyword(key), archive_job_methods, out);
+}
+
+static int getfd(const Janet *argv, int n) {
+    if (janet_checkabstract(argv[n], &janet_file_type)) {
+        FILE *f = janet_unwrapfile(argv[n], NULL);
+        fflush(f);
+        return fileno(f);
+    }
+    return janet_getinteger(argv, n);
+}
+
+static Janet start_job(struct archive *a, int fd, const char *dir, void *(*job_main)(void *)) {
+    ArchiveJob *job = calloc(1, sizeof(ArchiveJob));
+    if (!job)
+        janet_panic("out of memory");
+    /* One reference for the janet handle, one for the thread. */
+    job->refs = 2;
+    job->a = a;
+    job->dir = strdup(dir);
+    job->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (!job->dir || job->fd < 0) {
+        int _errno = job->dir ? errno : ENOMEM;
+        free(job->dir);
+        free(job);
+        janet_panicf("unable to start archive job - %s", strerror(_errno));
+    }
+    /* Strip trailing slashes so entry names can be cut after dir. */
+    size_t n = strlen(job->dir);
+    while (n > 1 && job->dir[n - 1] == '/')
+        job->dir[--n] = '\0';
+
+    ArchiveHandle *h = janet_abstract(&hermes_archive_job_type, sizeof(ArchiveHandle));
+    h->job = job;
+    h->running = 0;
+
+    /* Signals are for the janet thread, a broken pipe must show up as EPIPE. */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&h->thread, NULL, job_main, job);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        close(job->fd);
+        free(job->dir);
+        free(job);
+        h->job = NULL;
+        janet_panicf("unable to start archive job - %s", strerror(err));
+    }
+    h->running = 1;
+    return janet_wrap_abstract(h);
+}
+
+/* (archive-create fd dir &opt opts)
+
+   Start writing a tar archive of dir to fd, which may be a file or a
+   file descriptor number. opts may set :codec to :none, :lz4 (the
+   default), :gzip or :zstd, a compression :level, and the :threads
+   used by zstd, which default to the number of cpus. Returns a job to
+   :wait on. */
+Janet archive_create(int argc, Janet *argv) {
+    janet_arity(argc, 2, 3);
+    int fd = getfd(argv, 0);
+    const char *dir = (const char *)janet_getstring(argv, 1);
+    Janet codec = janet_ckeywordv("lz4");
+    Janet level = janet_wrap_nil();
+    Janet threads = janet_wrap_nil();
+    if (argc > 2 && !janet_checktype(argv[2], JANET_NIL)) {
+        JanetDictView opts = janet_getdictionary(argv, 2);
+        Janet v = janet_dictionary_get(opts.kvs, opts.cap, janet_ckeywordv("codec"));
+        if (!janet_checktype(v, JANET_NIL))
+            codec = v;
+        level = janet_dictionary_get(opts.kvs, opts.cap, janet_ckeywordv("level"));
+        threads = janet_dictionary_get(opts.kvs, opts.cap, janet_ckeywordv("threads"));
+    }
+
+    struct archive *a = archive_write_new();
+    if (!a)
+        janet_panic("out of memory");
+    int r;
+    int zstd = 0;
+    if (janet_keyeq(codec, "none")) {
+        /* There is nothing to set a level on. */
+        level = janet_wrap_nil();
+        r = archive_write_add_filter_none(a);
+    } else if (janet_keyeq(codec, "lz4")) {
+        r = archive_write_add_filter_lz4(a);
+    } else if (janet_keyeq(codec, "gzip")) {
+        r = archive_write_add_filter_gzip(a);
+    } else if (janet_keyeq(codec, "zstd")) {
+        r = archive_write_add_filter_zstd(a);
+        zstd = 1;
+    } else {
+        archive_write_free(a);
+        janet_panicf("unknown archive codec %v", codec);
+    }
+    if (r < ARCHIVE_WARN)
+        goto fail;
+
+    char buf[32];
+    if (!janet_checktype(level, JANET_NIL)) {
+        if (!janet_checkint(level)) {
+            archive_write_free(a);
+            janet_panicf("archive compression level must be an integer, got %v", level);
+        }
+        snprintf(buf, sizeof(buf), "%d", janet_unwrap_integer(level));
+        if (archive_write_set_filter_option(a, NULL, "compression-level", buf) != ARCHIVE_OK)
+            goto fail;
+    }
+    if (zstd) {
+        long n = janet_checkint(threads) ? janet_unwrap_integer(threads) : sysconf(_SC_NPROCESSORS_ONLN);
+        snprintf(buf, sizeof(buf), "%ld", n > 0 ? n : 1);
+        /* Older libarchive or libzstd only compress on one thread, that is fine. */
+        archive_write_set_filter_option(a, "zstd", "threads", buf);
+    }
+    if (archive_write_set_format_ustar(a) != ARCHIVE_OK)
+        goto fail;
+
+    return start_job(a, fd, dir, create_main);
+
+fail:
+    {
+        char err[256];
+        snprintf(err, sizeof(err), "%s", archive_error_string(a) ? archive_error_string(a) : "unknown error");
+        archive_write_free(a);
+        janet_panicf("unable to set up archive - %s", err);
+    }
+}
+
+/* (archive-extract fd dir)
+
+   Start unpacking a tar archive, compressed with any codec
+   archive-create supports, from fd into the existing directory dir.
+   Returns a job to :wait on. */
+Janet archive_extract(int argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    int fd = getfd(argv, 0);
+    const char *dir = (const char *)janet_getstring(argv, 1);
+
+    /* Entries are unpacked by absolute path, and secure symlink checks
+       refuse any symlink on it, including ones above dir. */
+    char resolved[PATH_MAX];
+    if (!realpath(dir, resolved))
+        janet_panicf("unable to unpack into %s - %s", dir, strerror(errno));
+
+    struct archive *a = archive_read_new();
+    if (!a)
+        janet_panic("out of memory");
+    archive_read_support_filter_none(a);
+    archive_read_support_filter_lz4(a);
+    archive_read_support_filter_gzip(a);
+    archive_read_support_filter_zstd(a);
+    archive_read_support_format_tar(a);
+    return start_job(a, fd, resolved, extract_main);
+}
@@ -0,0 +1,305 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <janet.h>
+#include "hermes.h"
+
+/* Content defined chunking of tar streams, for sending only the parts
+   of a package archive the receiver does not already have.
+
+   Chunk boundaries are picked with a gear rolling hash, so an edit only
+   changes the chunks around it. Boundaries are also forced wherever the
+   data of a regular file starts or ends, so every chunk is either
+   entirely file contents or entirely tar headers and padding. File
+   chunks are reported with the file path and offset, which lets the
+   receiver find them again in its own unpacked packages no matter how
+   the archive around them changed. Both ends must cut the same stream
+   the same way, so changing any of this needs a protocol bump. */
+
+#define CHUNK_MIN (16 * 1024)
+#define CHUNK_MAX (256 * 1024)
+/* 16 bits, so 64 KiB chunks on average past CHUNK_MIN. */
+#define CHUNK_MASK 0xffff000000000000ULL
+
+#define TAR_BLOCK 512
+#define TAR_PATH_MAX (155 + 1 + 100)
+
+static uint64_t gear[256];
+
+static void init_gear(void) {
+    static int done = 0;
+    if (done)
+        return;
+    /* splitmix64, any fixed table works as long as it never changes. */
+    uint64_t x = 0x6865726d65736364ULL;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    done = 1;
+}
+
+typedef struct {
+    int keep_data;
+
+    /* The chunk being built. */
+    Sha256ctx ctx;
+    uint64_t gear;
+    size_t len;
+    int is_file;
+    uint64_t file_offset;
+
+    /* Where we are in the tar stream. */
+    uint8_t hdr[TAR_BLOCK];
+    size_t hdr_fill;
+    uint64_t data_left;
+    uint64_t pad_left;
+    int in_file;
+    int bad_path;
+    int lost;
+    char path[TAR_PATH_MAX + 1];
+    uint64_t file_pos;
+
+    uint8_t data[CHUNK_MAX];
+} TarChunker;
+
+static int tar_chunker_get(void *p, Janet key, Janet *out);
+
+const JanetAbstractType hermes_tar_chunker_type = {
+    "_hermes/tar-chunker",
+    NULL,
+    NULL,
+    tar_chunker_get,
+    JANET_ATEND_GET
+};
+
+static void emit(TarChunker *c, JanetArray *out) {
+    uint8_t digest[32];
+    char hex[64];
+    sha256_finish(&c->ctx, digest);
+    base16_encode(hex, (char *)digest, sizeof(digest));
+
+    JanetKV *st = janet_struct_begin(2 + (c->is_file ? 2 : 0) + (c->keep_data ? 1 : 0));
+    janet_struct_put(st, janet_ckeywordv("hash"), janet_stringv((uint8_t *)hex, sizeof(hex)));
+    janet_struct_put(st, janet_ckeywordv("size"), janet_wrap_number(c->len));
+    if (c->is_file) {
+        janet_struct_put(st, janet_ckeywordv("path"), janet_cstringv(c->path));
+        janet_struct_put(st, janet_ckeywordv("offset"), janet_wrap_number(c->file_offset));
+    }
+    if (c->keep_data)
+        janet_struct_put(st, janet_ckeywordv("data"), janet_stringv(c->data, c->len));
+    janet_array_push(out, janet_wrap_struct(janet_struct_end(st)));
+
+    sha256_init(&c->ctx);
+    c->gear = 0;
+    c->len = 0;
+}
+
+/* Add n bytes of one kind to the stream, cutting chunks as we go. */
+static void feed(TarChunker *c, const uint8_t *b, size_t n, int is_file, JanetArray *out) {
+    if (c->len && c->is_file != is_file)
+        emit(c, out);
+    while (n) {
+        if (c->len == 0) {
+            c->is_file = is_file;
+            c->file_offset = c->file_pos;
+        }
+        size_t room = CHUNK_MAX - c->len;
+        size_t take = n < room ? n : room;
+        size_t i = 0;
+        int cut = take == room;
+        /* Nothing before CHUNK_MIN can be a boundary. */
+        if (c->len < CHUNK_MIN) {
+            size_t skip = CHUNK_MIN - c->len;
+            i = skip < take ? skip : take;
+        }
+        uint64_t g = c->gear;
+        for (; i < take; i++) {
+            g = (g << 1) + gear[b[i]];
+            if (!(g & CHUNK_MASK)) {
+                take = i + 1;
+                cut = 1;
+                break;
+            }
+        }
+        c->gear = g;
+        sha256_update(&c->ctx, (uint8_t *)b, take);
+        if (c->keep_data)
+            memcpy(c->data + c->len, b, take);
+        c->len += take;
+        if (is_file)
+            c->file_pos += take;
+        b += take;
+        n -= take;
+        if (cut)
+            emit(c, out);
+    }
+}
+
+static int parse_octal(const uint8_t *p, size_t n, uint64_t *v) {
+    uint64_t x = 0;
+    size_t i = 0;
+    while (i < n && p[i] == ' ')
+        i++;
+    if (i == n || p[i] < '0' || p[i] > '7')
+        return -1;
+    for (; i < n && p[i] >= '0' && p[i] <= '7'; i++) {
+        if (x >> 60)
+            return -1;
+        x = x * 8 + (p[i] - '0');
+    }
+    *v = x;
+    return 0;
+}
+
+static int parse_size(const uint8_t *hdr, uint64_t *size) {
+    const uint8_t *p = hdr + 124;
+    if (!(p[0] & 0x80))
+        return parse_octal(p, 12, size);
+    /* base-256, used for sizes too big for octal. */
+    uint64_t x = 0;
+    for (int i = 1; i < 12; i++) {
+        if (x >> 56)
+            return -1;
+        x = (x << 8) | p[i];
+    }
+    *size = x;
+    return 0;
+}
+
+/* Only paths that stay inside the package are worth remembering. */
+static int safe_path(const char *p) {
+    if (!*p || *p == '/')
+        return 0;
+    for (const char *s = p; s; s = strchr(s, '/')) {
+        if (*s == '/')
+            s++;
+        if (s[0] == '.' && s[1] == '.' && (s[2] == '/' || s[2] == '\0'))
+            return 0;
+    }
+    return 1;
+}
+
+static void parse_header(TarChunker *c) {
+    uint8_t *h = c->hdr;
+    int zero = 1;
+    for (int i = 0; i < TAR_BLOCK; i++)
+        if (h[i]) {
+            zero = 0;
+            break;
+        }
+    /* End of archive, the rest is zero padding. */
+    if (zero)
+        return;
+
+    uint64_t size;
+    if (parse_size(h, &size) != 0) {
+        /* Not a tar stream we understand, keep chunking it blindly. */
+        c->lost = 1;
+        return;
+    }
+    c->data_left = size;
+    c->pad_left = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+
+    uint8_t type = h[156];
+    int bad_path = c->bad_path;
+    /* Long names and pax headers change the meaning of the next header. */
+    c->bad_path = type == 'L' || type == 'K' || type == 'x' || type == 'g';
+    c->in_file = 0;
+    if (bad_path || size == 0 || (type != '0' && type != '\0' && type != '7'))
+        return;
+
+    size_t plen = strnlen((char *)h + 345, 155);
+    size_t nlen = strnlen((char *)h, 100);
+    char *p = c->path;
+    if (plen) {
+        memcpy(p, h + 345, plen);
+        p[plen++] = '/';
+    }
+    memcpy(p + plen, h, nlen);
+    p[plen + nlen] = '\0';
+    while (p[0] == '.' && p[1] == '/')
+        memmove(p, p + 2, strlen(p + 2) + 1);
+    if (!safe_path(p))
+        return;
+    c->in_file = 1;
+    c->file_pos = 0;
+}
+
+static void tar_chunker_push(TarChunker *c, const uint8_t *b, size_t n, JanetArray *out) {
+    while (n) {
+        size_t take;
+        if (c->lost) {
+            feed(c, b, n, 0, out);
+            return;
+        } else if (c->data_left) {
+            take = n < c->data_left ? n : c->data_left;
+            feed(c, b, take, c->in_file, out);
+            c->data_left -= take;
+        } else if (c->pad_left) {
+            take = n < c->pad_left ? n : c->pad_left;
+            feed(c, b, take, 0, out);
+            c->pad_left -= take;
+        } else {
+            size_t room = TAR_BLOCK - c->hdr_fill;
+            take = n < room ? n : room;
+            memcpy(c->hdr + c->hdr_fill, b, take);
+            feed(c, b, take, 0, out);
+            c->hdr_fill += take;
+            if (c->hdr_fill == TAR_BLOCK) {
+                c->hdr_fill = 0;
+                parse_header(c);
+            }
+        }
+        b += take;
+        n -= take;
+    }
+}
+
+static Janet tar_chunker_update(int argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    TarChunker *c = janet_getabstract(argv, 0, &hermes_tar_chunker_type);
+    JanetByteView bytes = janet_getbytes(argv, 1);
+    JanetArray *out = janet_array(0);
+    tar_chunker_push(c, bytes.bytes, bytes.len, out);
+    return janet_wrap_array(out);
+}
+
+static Janet tar_chunker_finish(int argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    TarChunker *c = janet_getabstract(argv, 0, &hermes_tar_chunker_type);
+    JanetArray *out = janet_array(0);
+    if (c->len)
+        emit(c, out);
+    return janet_wrap_array(out);
+}
+
+static JanetMethod tar_chunker_methods[] = {
+    {"update", tar_chunker_update},
+    {"finish", tar_chunker_finish},
+    {NULL, NULL}
+};
+
+static int tar_chunker_get(void *p, Janet key, Janet *out) {
+    (void) p;
+    if (!janet_checktype(key, JANET_KEYWORD))
+        return 0;
+    return janet_getmethod(janet_unwrap_keyword(key), tar_chunker_methods, out);
+}
+
+/* (tar-chunker &opt keep-data)
+
+   :update returns the chunks completed by the new data and :finish the
+   last one, as structs of :hash, :size and, for file contents, :path
+   and :offset. Chunks also carry their :data when keep-data is set. */
+Janet tar_chunker(int argc, Janet *argv) {
+    janet_arity(argc, 0, 1);
+    init_gear();
+    TarChunker *c = janet_abstract(&hermes_tar_chunker_type, sizeof(TarChunker));
+    memset(c, 0, offsetof(TarChunker, data));
+    c->keep_data = argc > 0 && janet_truthy(argv[0]);
+    sha256_init(&c->ctx);
+    return janet_wrap_abstract(c);
+}
@@ -0,0 +1,182 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <janet.h>
+#include <errno.h>
+#include "hermes.h"
+
+/* Copy a package between two stores on the same machine without
+   archiving it. Files that storify would leave untouched are
+   hardlinked, the rest are reflinked when the file system supports
+   it, and copied in the kernel with copy_file_range otherwise. */
+
+static int fcompare(const FTSENT** one, const FTSENT** two)
+{
+    return (strcmp((*one)->fts_name, (*two)->fts_name));
+}
+
+static void finalize_fts(void *p) {
+    FTS **pfs = p;
+    if (*pfs) fts_close(*pfs);
+};
+
+/* Storify would not change this file, so the copy may share its inode. */
+static int can_link(struct stat *st, uid_t uid, gid_t gid) {
+    return st->st_uid == uid
+        && st->st_gid == gid
+        && st->st_mtime == 0
+        && (st->st_mode & 07777) == ((st->st_mode & 0111) | 0444);
+}
+
+static int copy_fd_data(int sfd, int dfd) {
+    if (ioctl(dfd, FICLONE, sfd) == 0)
+        return 0;
+
+    int in_kernel = 1;
+    char buf[65536];
+    for (;;) {
+        ssize_t n;
+        if (in_kernel) {
+            n = copy_file_range(sfd, NULL, dfd, NULL, 1 << 30, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                in_kernel = 0;
+                continue;
+            }
+            if (n < 0)
+                return -1;
+            if (n == 0)
+                return 0;
+        } else {
+            n = read(sfd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                return -1;
+            if (n == 0)
+                return 0;
+            for (ssize_t off = 0; off < n;) {
+                ssize_t w = write(dfd, buf + off, n - off);
+                if (w < 0 && errno == EINTR)
+                    continue;
+                if (w < 0)
+                    return -1;
+                off += w;
+            }
+        }
+    }
+}
+
+static void copy_file(const char *src, const char *dest, struct stat *st) {
+    int sfd = open(src, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (sfd < 0)
+        janet_panicf("unable to open %s - %s", src, strerror(errno));
+    int dfd = open(dest, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, (st->st_mode & 0777) | 0600);
+    if (dfd < 0) {
+        int _errno = errno;
+        close(sfd);
+        janet_panicf("unable to create %s - %s", dest, strerror(_errno));
+    }
+    int ok = copy_fd_data(sfd, dfd) == 0;
+    int _errno = errno;
+    close(sfd);
+    if (close(dfd) != 0 && ok) {
+        ok = 0;
+        _errno = errno;
+    }
+    if (!ok)
+        janet_panicf("unable to copy %s - %s", src, strerror(_errno));
+}
+
+/* (copy-tree src dest src-uid dest-uid dest-gid)
+
+   Every entry under src must be owned by src-uid, so a store can only
+   be made to copy files its owner controls. dest must not exist, the
+   copy still needs to be storified. */
+Janet copy_tree(int argc, Janet *argv) {
+    janet_fixarity(argc, 5);
+    const char *src = (const char *)janet_getstring(argv, 0);
+    const char *dest = (const char *)janet_getstring(argv, 1);
+    uid_t src_uid = janet_getinteger(argv, 2);
+    uid_t dest_uid = janet_getinteger(argv, 3);
+    gid_t dest_gid = janet_getinteger(argv, 4);
+
+    FTS **pfs = janet_smalloc(sizeof(FTS*));
+    *pfs = NULL;
+    janet_sfinalizer(pfs, finalize_fts);
+
+    const char *paths[] = {src, NULL};
+    *pfs = fts_open((char * const *)paths, FTS_NOCHDIR|FTS_PHYSICAL|FTS_XDEV, &fcompare);
+    if (!*pfs)
+        janet_panicf("unable to open directory %s - %s", src, strerror(errno));
+
+    size_t srclen = strlen(src);
+    int can_hardlink = 1;
+    char path[PATH_MAX];
+    char target[PATH_MAX];
+    FTSENT *fent;
+
+    while ((errno = 0, fent = fts_read(*pfs))) {
+        switch (fent->fts_info) {
+        case FTS_DP:
+            continue;
+        case FTS_NS:
+        case FTS_DNR:
+        case FTS_ERR:
+            janet_panicf("unable to copy %s - %s", fent->fts_path, strerror(fent->fts_errno));
+        default:
+            break;
+        }
+
+        if (fent->fts_level == 0 && fent->fts_info != FTS_D)
+            janet_panicf("unable to copy %s - not a directory", src);
+
+        struct stat *st = fent->fts_statp;
+        if (st->st_uid != src_uid)
+            janet_panicf("unable to copy %s - not owned by the source store", fent->fts_path);
+
+        if (snprintf(path, sizeof(path), "%s%s", dest, fent->fts_path + srclen) >= (int)sizeof(path))
+            janet_panicf("unable to copy %s - path too long", fent->fts_path);
+
+        switch (fent->fts_info) {
+        case FTS_D:
+            if (mkdir(path, 0700) != 0)
+                janet_panicf("unable to create %s - %s", path, strerror(errno));
+            break;
+        case FTS_SL:
+        case FTS_SLNONE: {
+            ssize_t n = readlink(fent->fts_accpath, target, sizeof(target) - 1);
+            if (n < 0)
+                janet_panicf("unable to read link %s - %s", fent->fts_path, strerror(errno));
+            target[n] = '\0';
+            if (symlink(target, path) != 0)
+                janet_panicf("unable to create %s - %s", path, strerror(errno));
+            break;
+        }
+        case FTS_F:
+            if (can_hardlink && can_link(st, dest_uid, dest_gid)) {
+                if (link(fent->fts_accpath, path) == 0)
+                    break;
+                /* Most likely another file system, don't keep trying. */
+                if (errno == EXDEV || errno == EPERM)
+                    can_hardlink = 0;
+                else if (errno != EMLINK)
+                    janet_panicf("unable to link %s - %s", path, strerror(errno));
+            }
+            copy_file(fent->fts_accpath, path, st);
+            break;
+        default:
+            janet_panicf("unsupported file at %s", fent->fts_path);
+        }
+    }
+    if (errno != 0)
+        janet_panicf("unable to copy %s - %s", src, strerror(errno));
+
+    janet_sfree(pfs);
+    return janet_wrap_nil();
+}
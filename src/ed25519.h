@@ -0,0 +1,10 @@
+/* Ed25519 signatures, as used by signify.
+
+   Secret keys are 64 bytes, the 32 byte seed followed by the public
+   key. The arithmetic follows TweetNaCl, it is small and constant
+   time, if not fast. None of this code touches janet. */
+
+void ed25519_public_key(uint8_t pk[32], const uint8_t seed[32]);
+void ed25519_sign(uint8_t sig[64], const uint8_t *msg, size_t len, const uint8_t sk[64]);
+/* Returns 0 if sig is a valid signature of msg by pk. */
+int ed25519_verify(const uint8_t sig[64], const uint8_t *msg, size_t len, const uint8_t pk[32]);
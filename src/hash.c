@@ -1,20 +1,26 @@
 #define _POSIX_C_SOURCE 200809L
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
 #include <janet.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 #include "hermes.h"
-#include "sha256.h"
+#include "threadpool.h"
 #include "fts.h"
 
 typedef struct {
     enum {
         kind_sha256,
+        kind_buffer,
     } kind;
     union {
         Sha256ctx *sha256;
+        JanetBuffer *buffer;
     } ctx;
 } Hasher;
 
@@ -23,6 +29,9 @@ static void hasher_add(Hasher *h, char *b, size_t n) {
     case kind_sha256:
         sha256_update(h->ctx.sha256, (uint8_t*)b, n);
         break;
+    case kind_buffer:
+        janet_buffer_push_bytes(h->ctx.buffer, (uint8_t*)b, n);
+        break;
     default:
         abort();
     }
@@ -54,10 +63,29 @@ static void hasher_add_int64(Hasher *h, int64_t x) {
     hasher_add(h, buf, sizeof(buf));
 }
 
+static int hasher_add_chunk(void *h, const uint8_t *b, size_t n) {
+    hasher_add(h, (char*)b, n);
+    return 0;
+}
+
+static int hasher_add_fd(Hasher *h, int fd) {
+    return read_file_fd(fd, hasher_add_chunk, h) == 0;
+}
+
 static int hasher_add_file(Hasher *h, FILE *f) {
-    char buf[4096];
+    /* If the stream is seekable, bypass stdio and hash from
+       the descriptor, leaving the stream at end of file. */
+    off_t off = ftello(f);
+    if (off >= 0 && fflush(f) == 0 && lseek(fileno(f), off, SEEK_SET) >= 0) {
+        int ok = hasher_add_fd(h, fileno(f));
+        if (fseeko(f, 0, SEEK_END) != 0)
+            return 0;
+        return ok;
+    }
+
+    char buf[65536];
     while (1) {
-        int n = fread(buf, 1, sizeof(buf), f);
+        size_t n = fread(buf, 1, sizeof(buf), f);
         if (n > 0) {
             hasher_add(h, buf, n);
         }
@@ -69,11 +97,11 @@ static int hasher_add_file(Hasher *h, FILE *f) {
 
 static void hasher_add_file_contents_at_path(Hasher *h, const char *path) {
 
-    FILE *f = fopen(path, "rb");
-    if (!f)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
         janet_panicf("unable to open %s: %s", path, strerror(errno));
-    int ok = hasher_add_file(h, f);
-    fclose(f);
+    int ok = hasher_add_fd(h, fd);
+    close(fd);
     if (!ok)
         janet_panicf("io error while hashing %s", path);
 }
@@ -88,6 +116,74 @@ static void finalize_fts(void *p) {
     if (*pfs) fts_close(*pfs);
 };
 
+typedef struct {
+    Hasher *h;
+    ReadFileFn tee;
+    void *tee_ud;
+} TeeHasher;
+
+static int tee_hasher_add_chunk(void *p, const uint8_t *b, size_t n) {
+    TeeHasher *th = p;
+    hasher_add(th->h, (char*)b, n);
+    return th->tee(th->tee_ud, b, n);
+}
+
+static void hasher_add_file_header(Hasher *h, FTSENT *fent) {
+    hasher_add_byte(h, 1);
+    hasher_add(h, fent->fts_name, fent->fts_namelen);
+    hasher_add_int32(h, fent->fts_level);
+    hasher_add_int32(h, fent->fts_statp->st_mode & 0111);
+    hasher_add_int64(h, fent->fts_statp->st_size);
+}
+
+/* Hash a single entry of an fts walk, every byte of file and link
+   content is also passed to tee when it is not NULL. */
+static void dir_hash_ent(Hasher *h, FTSENT *fent, ReadFileFn tee, void *tee_ud) {
+    switch (fent->fts_info) {
+    case FTS_DP:
+        if (fent->fts_level) {
+            hasher_add_byte(h, 0);
+            hasher_add_int32(h, fent->fts_level);
+            hasher_add(h, fent->fts_name, fent->fts_namelen);
+            hasher_add_int32(h, fent->fts_statp->st_mode & 0111);
+        }
+        break;
+    case FTS_D:
+        /* hashed above */
+        break;
+    case FTS_F: {
+        hasher_add_file_header(h, fent);
+        if (tee) {
+            int fd = open(fent->fts_accpath, O_RDONLY);
+            if (fd < 0)
+                janet_panicf("unable to open %s: %s", fent->fts_accpath, strerror(errno));
+            TeeHasher th = {h, tee, tee_ud};
+            int rc = read_file_fd(fd, tee_hasher_add_chunk, &th);
+            close(fd);
+            if (rc)
+                janet_panicf("io error while hashing %s", fent->fts_accpath);
+        } else {
+            hasher_add_file_contents_at_path(h, fent->fts_accpath);
+        }
+        break;
+    }
+    case FTS_SL: {
+        hasher_add_byte(h, 2);
+        char *lnkbuf = janet_smalloc(fent->fts_statp->st_size);
+        ssize_t nchars = readlink((char *)fent->fts_accpath, lnkbuf, fent->fts_statp->st_size);
+        if (nchars < 0)
+            janet_panicf("unable to read link at %s: %s", fent->fts_accpath, strerror(errno));
+        hasher_add(h, lnkbuf, nchars);
+        if (tee)
+            tee(tee_ud, (uint8_t*)lnkbuf, nchars);
+        janet_sfree(lnkbuf);
+        break;
+    }
+    default:
+        janet_panicf("unsupported file at %s%s", fent->fts_path, fent->fts_name);
+    }
+}
+
 static void
 dir_hash(Hasher *h, const char *fpath)
 {
@@ -113,43 +209,160 @@ dir_hash(Hasher *h, const char *fpath)
                 janet_panicf("%s", strerror(errno));
             break;
         }
-        switch (fent->fts_info) {
-        case FTS_DP:
-            if (fent->fts_level) {
-                hasher_add_byte(h, 0);
-                hasher_add_int32(h, fent->fts_level);
-                hasher_add(h, fent->fts_name, fent->fts_namelen);
-                hasher_add_int32(h, fent->fts_statp->st_mode & 0111);
-            }
-            break;
-        case FTS_D:
-            /* hashed above */
-            break;
-        case FTS_F: {
-            hasher_add_byte(h, 1);
-            hasher_add(h, fent->fts_name, fent->fts_namelen);
-            hasher_add_int32(h, fent->fts_level);
-            hasher_add_int32(h, fent->fts_statp->st_mode & 0111);
-            hasher_add_int64(h, fent->fts_statp->st_size);
-            hasher_add_file_contents_at_path(h, fent->fts_accpath);
-            break;
+        dir_hash_ent(h, fent, NULL, NULL);
+    }
+
+    janet_sfree(pfs);
+}
+
+void sha256_dir_hash_ent(Sha256ctx *ctx, FTSENT *fent, ReadFileFn tee, void *tee_ud) {
+    Hasher h;
+    h.kind = kind_sha256;
+    h.ctx.sha256 = ctx;
+    dir_hash_ent(&h, fent, tee, tee_ud);
+}
+
+/* Tree hashing uses the same entry encoding as dir_hash, except the
+   contents of each file are replaced by their own sha256 digest. The
+   file digests are computed on a thread pool while the walk builds
+   the entry stream, then patched into the stream and the whole stream
+   is hashed in walk order. */
+
+typedef struct {
+    size_t offset; /* where the digest goes in the entry stream. */
+    uint8_t digest[32];
+    char path[];
+} TreeHashTask;
+
+typedef struct {
+    ThreadPool *pool;
+    TreeHashTask **tasks;
+    size_t ntasks;
+    size_t cap;
+    pthread_mutex_t lock;
+    int failed;
+    char err[PATH_MAX + 64];
+} TreeHash;
+
+static int tree_hash_chunk(void *ctx, const uint8_t *b, size_t n) {
+    sha256_update(ctx, (uint8_t*)b, n);
+    return 0;
+}
+
+static void tree_hash_task(ThreadPool *pool, int worker, void *task, void *ud) {
+    (void)pool;
+    (void)worker;
+    TreeHash *th = ud;
+    TreeHashTask *t = task;
+    Sha256ctx ctx;
+
+    sha256_init(&ctx);
+    int fd = open(t->path, O_RDONLY);
+    int rc = fd < 0 ? -1 : read_file_fd(fd, tree_hash_chunk, &ctx);
+    if (fd >= 0)
+        close(fd);
+    if (rc) {
+        pthread_mutex_lock(&th->lock);
+        if (!th->failed) {
+            th->failed = 1;
+            snprintf(th->err, sizeof(th->err), "io error while hashing %s", t->path);
         }
-        case FTS_SL: {
-            hasher_add_byte(h, 2);
-            char *lnkbuf = janet_smalloc(fent->fts_statp->st_size);
-            ssize_t nchars = readlink((char *)fent->fts_accpath, lnkbuf, fent->fts_statp->st_size);
-            if (nchars < 0)
-                janet_panicf("unable to read link at %s: %s", fent->fts_accpath, strerror(errno));
-            hasher_add(h, lnkbuf, nchars);
-            janet_sfree(lnkbuf);
+        pthread_mutex_unlock(&th->lock);
+        return;
+    }
+    sha256_finish(&ctx, t->digest);
+}
+
+static void finalize_tree_hash(void *p) {
+    TreeHash *th = p;
+    thread_pool_wait(th->pool);
+    thread_pool_free(th->pool);
+    for (size_t i = 0; i < th->ntasks; i++)
+        free(th->tasks[i]);
+    free(th->tasks);
+    pthread_mutex_destroy(&th->lock);
+}
+
+static void tree_hash_submit(TreeHash *th, const char *path, size_t offset) {
+    if (th->ntasks == th->cap) {
+        th->cap = th->cap ? th->cap * 2 : 64;
+        TreeHashTask **tasks = realloc(th->tasks, th->cap * sizeof(TreeHashTask*));
+        if (!tasks)
+            janet_panic("out of memory");
+        th->tasks = tasks;
+    }
+    size_t n = strlen(path) + 1;
+    TreeHashTask *t = malloc(sizeof(TreeHashTask) + n);
+    if (!t)
+        janet_panic("out of memory");
+    t->offset = offset;
+    memcpy(t->path, path, n);
+    th->tasks[th->ntasks++] = t;
+    thread_pool_submit(th->pool, -1, t);
+}
+
+static void
+tree_hash(Sha256ctx *ctx, const char *fpath, int nthreads)
+{
+    FTS** pfs = NULL;
+    FTSENT* fent = NULL;
+    errno = 0;
+
+    TreeHash *th = janet_smalloc(sizeof(TreeHash));
+    th->tasks = NULL;
+    th->ntasks = 0;
+    th->cap = 0;
+    th->failed = 0;
+    pthread_mutex_init(&th->lock, NULL);
+    th->pool = thread_pool_new(nthreads, tree_hash_task, th);
+    janet_sfinalizer(th, finalize_tree_hash);
+
+    pfs = janet_smalloc(sizeof(FTS*));
+    *pfs = NULL;
+    janet_sfinalizer(pfs, finalize_fts);
+
+    const char *paths[] = {fpath, NULL};
+
+    *pfs = fts_open((char * const *)paths, FTS_NOCHDIR|FTS_PHYSICAL, &fcompare);
+    if (!*pfs)
+        janet_panicf("unable to open directory");
+
+    JanetBuffer *stream = janet_buffer(4096);
+    Hasher h;
+    h.kind = kind_buffer;
+    h.ctx.buffer = stream;
+
+    while(1) {
+        fent = fts_read(*pfs);
+        if (!fent) {
+            if (errno != 0)
+                janet_panicf("%s", strerror(errno));
             break;
         }
-        default:
-            janet_panicf("unsupported file at %s%s", fent->fts_path, fent->fts_name);
+        if (fent->fts_info == FTS_F) {
+            char placeholder[32] = {0};
+            hasher_add_file_header(&h, fent);
+            tree_hash_submit(th, fent->fts_accpath, stream->count);
+            hasher_add(&h, placeholder, sizeof(placeholder));
+        } else {
+            dir_hash_ent(&h, fent, NULL, NULL);
         }
     }
 
     janet_sfree(pfs);
+
+    thread_pool_wait(th->pool);
+    if (th->failed) {
+        char err[sizeof(th->err)];
+        memcpy(err, th->err, sizeof(err));
+        janet_sfree(th);
+        janet_panicf("%s", err);
+    }
+    for (size_t i = 0; i < th->ntasks; i++)
+        memcpy(stream->data + th->tasks[i]->offset, th->tasks[i]->digest, 32);
+    janet_sfree(th);
+
+    sha256_update(ctx, stream->data, stream->count);
 }
 
 Janet sha256_dir_hash(int argc, Janet *argv) {
@@ -168,6 +381,24 @@ Janet sha256_dir_hash(int argc, Janet *argv) {
     return janet_stringv(hexbuf, sizeof(hexbuf));
 }
 
+Janet sha256_tree_hash(int argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    const char *p = (const char*)janet_getstring(argv, 0);
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc >= 2)
+        nthreads = janet_getinteger(argv, 1);
+    if (nthreads < 1)
+        nthreads = 1;
+    Sha256ctx ctx;
+    sha256_init(&ctx);
+    tree_hash(&ctx, p, nthreads);
+    uint8_t buf[32];
+    uint8_t hexbuf[sizeof(buf)*2];
+    sha256_finish(&ctx, buf);
+    base16_encode((char*)hexbuf, (char*)buf, sizeof(buf));
+    return janet_stringv(hexbuf, sizeof(hexbuf));
+}
+
 Janet sha256_file_hash(int argc, Janet *argv) {
     janet_fixarity(argc, 1);
     Sha256ctx ctx;
@@ -190,3 +421,155 @@ Janet sha256_file_hash(int argc, Janet *argv) {
     base16_encode((char*)hexbuf, (char*)buf, sizeof(buf));
     return janet_stringv(hexbuf, sizeof(hexbuf));
 }
+
+/* An incremental sha256, for hashing data as it streams past. */
+
+static int sha256_stream_get(void *p, Janet key, Janet *out);
+
+const JanetAbstractType hermes_sha256_stream_type = {
+    "_hermes/sha256-stream",
+    NULL,
+    NULL,
+    sha256_stream_get,
+    JANET_ATEND_GET
+};
+
+static Janet sha256_stream_update(int argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    Sha256ctx *ctx = janet_getabstract(argv, 0, &hermes_sha256_stream_type);
+    JanetByteView bytes = janet_getbytes(argv, 1);
+    sha256_update(ctx, (uint8_t*)bytes.bytes, bytes.len);
+    return argv[0];
+}
+
+static Janet sha256_stream_digest(int argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    Sha256ctx *ctx = janet_getabstract(argv, 0, &hermes_sha256_stream_type);
+    /* Finish a copy so the stream can still be updated. */
+    Sha256ctx fin = *ctx;
+    uint8_t buf[32];
+    uint8_t hexbuf[sizeof(buf)*2];
+    sha256_finish(&fin, buf);
+    base16_encode((char*)hexbuf, (char*)buf, sizeof(buf));
+    return janet_stringv(hexbuf, sizeof(hexbuf));
+}
+
+static JanetMethod sha256_stream_methods[] = {
+    {"update", sha256_stream_update},
+    {"digest", sha256_stream_digest},
+    {NULL, NULL}
+};
+
+static int sha256_stream_get(void *p, Janet key, Janet *out) {
+    (void) p;
+    if (!janet_checktype(key, JANET_KEYWORD))
+        return 0;
+    return janet_getmethod(janet_unwrap_keyword(key), sha256_stream_methods, out);
+}
+
+Janet sha256_stream(int argc, Janet *argv) {
+    (void)argv;
+    janet_fixarity(argc, 0);
+    Sha256ctx *ctx = janet_abstract(&hermes_sha256_stream_type, sizeof(Sha256ctx));
+    sha256_init(ctx);
+    return janet_wrap_abstract(ctx);
+}
+
+/* A digest of the metadata of every entry under a path, for keying
+   cached content hashes. Anything that changes content also changes
+   ctime, which cannot be set from userspace. Entries modified within
+   the last couple of seconds are considered racy, since a later
+   write in the same timestamp tick would go unnoticed, and no
+   fingerprint is returned for them. */
+
+#define FINGERPRINT_RACY_SECS 2
+
+static int fingerprint_ent(Hasher *h, FTSENT *fent, time_t racy_after) {
+    struct stat *st = fent->fts_statp;
+
+    if (st->st_ctim.tv_sec >= racy_after || st->st_mtim.tv_sec >= racy_after)
+        return 0;
+
+    hasher_add_int32(h, fent->fts_info);
+    hasher_add_int32(h, fent->fts_level);
+    hasher_add(h, fent->fts_name, fent->fts_namelen);
+    hasher_add_int64(h, st->st_dev);
+    hasher_add_int64(h, st->st_ino);
+    hasher_add_int64(h, st->st_mode);
+    hasher_add_int64(h, st->st_size);
+    hasher_add_int64(h, st->st_mtim.tv_sec);
+    hasher_add_int64(h, st->st_mtim.tv_nsec);
+    hasher_add_int64(h, st->st_ctim.tv_sec);
+    hasher_add_int64(h, st->st_ctim.tv_nsec);
+    return 1;
+}
+
+Janet stat_fingerprint(int argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    const char *p = (const char*)janet_getstring(argv, 0);
+
+    FTS** pfs = NULL;
+    FTSENT* fent = NULL;
+    errno = 0;
+
+    struct timespec now;
+    if (clock_gettime(CLOCK_REALTIME, &now) != 0)
+        janet_panicf("unable to get time - %s", strerror(errno));
+    time_t racy_after = now.tv_sec - FINGERPRINT_RACY_SECS;
+
+    pfs = janet_smalloc(sizeof(FTS*));
+    *pfs = NULL;
+    janet_sfinalizer(pfs, finalize_fts);
+
+    const char *paths[] = {p, NULL};
+
+    *pfs = fts_open((char * const *)paths, FTS_NOCHDIR|FTS_PHYSICAL, &fcompare);
+    if (!*pfs)
+        janet_panicf("unable to open %s", p);
+
+    Sha256ctx ctx;
+    sha256_init(&ctx);
+    Hasher h;
+    h.kind = kind_sha256;
+    h.ctx.sha256 = &ctx;
+
+    int ok = 1;
+    while(ok) {
+        fent = fts_read(*pfs);
+        if (!fent) {
+            if (errno != 0)
+                janet_panicf("%s", strerror(errno));
+            break;
+        }
+        switch (fent->fts_info) {
+        case FTS_D:
+            break;
+        case FTS_DP:
+        case FTS_F:
+        case FTS_SL:
+            ok = fingerprint_ent(&h, fent, racy_after);
+            break;
+        default:
+            ok = 0;
+        }
+    }
+
+    janet_sfree(pfs);
+
+    if (!ok)
+        return janet_wrap_nil();
+
+    uint8_t buf[32];
+    uint8_t hexbuf[sizeof(buf)*2];
+    sha256_finish(&ctx, buf);
+    base16_encode((char*)hexbuf, (char*)buf, sizeof(buf));
+    return janet_stringv(hexbuf, sizeof(hexbuf));
+}
+
+Janet jsha256_self_test(int argc, Janet *argv) {
+    (void)argv;
+    janet_fixarity(argc, 0);
+    if (sha256_self_test() != 0)
+        janet_panic("sha256 self test failed");
+    return janet_wrap_nil();
+}
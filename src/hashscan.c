@@ -6,188 +6,484 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include "hermes.h"
+#include "threadpool.h"
+
+/* A reference is $STORE/hpkg/$HASH. Instead of pushing every byte
+   through a state machine, we search for the '/hpkg/' anchor (with
+   SIMD when we can), then check the store path backwards and the
+   hash forwards. The tail of each buffer is carried over so references
+   spanning read boundaries are still found.
+
+   The tree is walked by a work stealing thread pool, each worker
+   collects hashes into its own set, and the sets are merged into the
+   janet table once every worker has stopped. Nothing run by the
+   pool may touch the janet heap or panic. */
+
+#define ANCHOR "/hpkg/"
+#define ANCHOR_LEN 6
+#define MAX_SCAN_DEPTH 1000
+
+typedef struct {
+    size_t count;
+    size_t cap;
+    uint8_t *slots; /* cap * HASH_SZ*2 bytes, an empty slot starts with 0. */
+} FoundSet;
 
 typedef struct {
-    enum scan_state {
-        ST_PREFIX1,
-        ST_PREFIX2,
-        ST_HASH,
-    } state;
-    JanetString store_path;
+    const uint8_t *store_path;
     size_t store_path_len;
-    JanetTable *hashes;
-    size_t path_sz;
-    size_t n_matched;
-    char hash[HASH_SZ*2];
+    size_t pattern_len;
+    FoundSet *found;
+    size_t n_carry;
+    uint8_t *carry;  /* last pattern_len-1 bytes seen. */
+    uint8_t *stitch; /* carry + head of the next buffer. */
 } Scanner;
 
-static void init_scanner(Scanner *s, JanetString store_path, JanetTable *hashes) {
-    s->state = ST_PREFIX1;
-    s->hashes = hashes;
+static const uint8_t hex_lut[256] = {
+    ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1,
+    ['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1,
+    ['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1,
+};
+
+static void *xmalloc(size_t n) {
+    void *p = malloc(n);
+    if (!p)
+        abort();
+    return p;
+}
+
+static void found_set_init(FoundSet *set) {
+    set->count = 0;
+    set->cap = 64;
+    set->slots = calloc(set->cap, HASH_SZ*2);
+    if (!set->slots)
+        abort();
+}
+
+static void found_set_deinit(FoundSet *set) {
+    free(set->slots);
+}
+
+static size_t found_set_slot(size_t cap, const uint8_t *hash) {
+    /* FNV-1a over a prefix, the hashes are already uniformly distributed. */
+    uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i < 16; i++)
+        h = (h ^ hash[i]) * 1099511628211ULL;
+    return h & (cap - 1);
+}
+
+static void found_set_add(FoundSet *set, const uint8_t *hash);
+
+static void found_set_grow(FoundSet *set) {
+    FoundSet bigger;
+    bigger.count = 0;
+    bigger.cap = set->cap * 2;
+    bigger.slots = calloc(bigger.cap, HASH_SZ*2);
+    if (!bigger.slots)
+        abort();
+    for (size_t i = 0; i < set->cap; i++) {
+        uint8_t *slot = set->slots + i * HASH_SZ*2;
+        if (slot[0])
+            found_set_add(&bigger, slot);
+    }
+    free(set->slots);
+    *set = bigger;
+}
+
+static void found_set_add(FoundSet *set, const uint8_t *hash) {
+    if ((set->count + 1) * 2 > set->cap)
+        found_set_grow(set);
+    size_t i = found_set_slot(set->cap, hash);
+    while (1) {
+        uint8_t *slot = set->slots + i * HASH_SZ*2;
+        if (!slot[0]) {
+            memcpy(slot, hash, HASH_SZ*2);
+            set->count++;
+            return;
+        }
+        if (memcmp(slot, hash, HASH_SZ*2) == 0)
+            return;
+        i = (i + 1) & (set->cap - 1);
+    }
+}
+
+static void init_scanner(Scanner *s, const uint8_t *store_path, size_t store_path_len, FoundSet *found) {
+    s->found = found;
     s->store_path = store_path;
-    s->store_path_len = janet_string_length(store_path);
-    s->n_matched = 0;
-}
-
-static void scan_buf(Scanner *s, char *buf, size_t n) {
-    static char prefix2[6] = "/hpkg/";
-
-    for (size_t i = 0; i < n; i++) {
-again:
-        switch (s->state) {
-        case ST_PREFIX1:
-            if (!s->store_path_len) {
-                /* If the store path is "", then nothing to do. */
-                s->n_matched = 0;
-                s->state = ST_PREFIX2;
-                goto again;
-            }
-            if (buf[i] == s->store_path[s->n_matched]) {
-                s->n_matched++;
-            } else {
-                s->n_matched = 0;
-                break;
-            }
-            if (s->n_matched == s->store_path_len) {
-                s->n_matched = 0;
-                s->state = ST_PREFIX2;
-            }
-            break;
-        case ST_PREFIX2: {
-            if (buf[i] == (prefix2[s->n_matched])) {
-                s->n_matched++;
-            } else {
-                s->n_matched = 0;
-                if (s->store_path_len) {
-                    s->state = ST_PREFIX1;
-                    goto again;
-                }
-            }
-            if (s->n_matched == sizeof(prefix2)) {
-                s->n_matched = 0;
-                s->state = ST_HASH;
-            }
-            break;
+    s->store_path_len = store_path_len;
+    s->pattern_len = s->store_path_len + ANCHOR_LEN + HASH_SZ*2;
+    s->n_carry = 0;
+    s->carry = xmalloc(3 * s->pattern_len);
+    s->stitch = s->carry + s->pattern_len;
+}
+
+static void reset_scanner(Scanner *s) {
+    s->n_carry = 0;
+}
+
+static void finish_scanner(Scanner *s) {
+    free(s->carry);
+}
+
+static const uint8_t *find_anchor_generic(const uint8_t *p, const uint8_t *end) {
+    while (end - p >= ANCHOR_LEN) {
+        p = memchr(p, '/', (end - p) - (ANCHOR_LEN - 1));
+        if (!p)
+            return NULL;
+        if (memcmp(p, ANCHOR, ANCHOR_LEN) == 0)
+            return p;
+        p++;
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/* Compare the first two bytes and the last byte of the anchor across
+   a whole vector, only candidates that pass all three get a memcmp. */
+
+__attribute__((target("sse2")))
+static const uint8_t *find_anchor_sse2(const uint8_t *p, const uint8_t *end) {
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i h = _mm_set1_epi8('h');
+    while (end - p >= 16 + ANCHOR_LEN - 1) {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + 1));
+        __m128i c = _mm_loadu_si128((const __m128i *)(p + ANCHOR_LEN - 1));
+        unsigned mask = _mm_movemask_epi8(
+                            _mm_and_si128(_mm_cmpeq_epi8(a, slash),
+                                          _mm_and_si128(_mm_cmpeq_epi8(b, h), _mm_cmpeq_epi8(c, slash))));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(p + bit, ANCHOR, ANCHOR_LEN) == 0)
+                return p + bit;
+            mask &= mask - 1;
         }
-        case ST_HASH: {
-            char c = buf[i];
-            if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')) {
-                s->hash[s->n_matched++] = c;
-            } else {
-                s->n_matched = 0;
-                s->state = ST_PREFIX1;
-                goto again;
-            }
-            if (s->n_matched == sizeof(s->hash)) {
-                s->n_matched = 0;
-                s->state = ST_PREFIX1;
-                janet_table_put(s->hashes, janet_stringv((const uint8_t*)s->hash, sizeof(s->hash)), janet_wrap_boolean(1));
-            }
-            break;
+        p += 16;
+    }
+    return find_anchor_generic(p, end);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *find_anchor_avx2(const uint8_t *p, const uint8_t *end) {
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i h = _mm256_set1_epi8('h');
+    while (end - p >= 32 + ANCHOR_LEN - 1) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + 1));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(p + ANCHOR_LEN - 1));
+        unsigned mask = _mm256_movemask_epi8(
+                            _mm256_and_si256(_mm256_cmpeq_epi8(a, slash),
+                                             _mm256_and_si256(_mm256_cmpeq_epi8(b, h), _mm256_cmpeq_epi8(c, slash))));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(p + bit, ANCHOR, ANCHOR_LEN) == 0)
+                return p + bit;
+            mask &= mask - 1;
         }
-        default:
-            abort();
+        p += 32;
+    }
+    return find_anchor_sse2(p, end);
+}
+
+static const uint8_t *(*resolve_find_anchor(void))(const uint8_t *, const uint8_t *) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return find_anchor_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return find_anchor_sse2;
+    return find_anchor_generic;
+}
+
+#else
+
+static const uint8_t *(*resolve_find_anchor(void))(const uint8_t *, const uint8_t *) {
+    return find_anchor_generic;
+}
+
+#endif
+
+/* Resolved on the janet thread before any workers start. */
+static const uint8_t *(*find_anchor_impl)(const uint8_t *, const uint8_t *) = NULL;
+
+/* Find the next "/hpkg/" lying wholly within [p, end). */
+static const uint8_t *find_anchor(const uint8_t *p, const uint8_t *end) {
+    return find_anchor_impl(p, end);
+}
+
+static void scan_region(Scanner *s, const uint8_t *buf, size_t n) {
+    if (n < s->pattern_len)
+        return;
+
+    const uint8_t *p = buf + s->store_path_len;
+    const uint8_t *end = buf + n - HASH_SZ*2;
+
+    while ((p = find_anchor(p, end))) {
+        const uint8_t *hash = p + ANCHOR_LEN;
+        int ok = memcmp(p - s->store_path_len, s->store_path, s->store_path_len) == 0;
+        for (size_t i = 0; ok && i < HASH_SZ*2; i++)
+            ok = hex_lut[hash[i]];
+        if (ok) {
+            found_set_add(s->found, hash);
+            p = hash + HASH_SZ*2;
+        } else {
+            p += 1;
         }
     }
 }
 
-static void scan_file(Scanner *s, FILE *f) {
-    char buf[8192];
+static void scan_buf(Scanner *s, const uint8_t *buf, size_t n) {
+    size_t keep_max = s->pattern_len - 1;
 
-    while (1) {
-        size_t n = fread(buf, 1, sizeof(buf), f);
-        if (n == 0)
-            break;
-        scan_buf(s, buf, n);
+    if (s->n_carry) {
+        size_t head = n < keep_max ? n : keep_max;
+        memcpy(s->stitch, s->carry, s->n_carry);
+        memcpy(s->stitch + s->n_carry, buf, head);
+        scan_region(s, s->stitch, s->n_carry + head);
     }
 
-    if (ferror(f))
-        janet_panic("io error while scanning for package references");
+    scan_region(s, buf, n);
+
+    if (n >= keep_max) {
+        memcpy(s->carry, buf + n - keep_max, keep_max);
+        s->n_carry = keep_max;
+    } else {
+        size_t keep = s->n_carry < keep_max - n ? s->n_carry : keep_max - n;
+        memmove(s->carry, s->carry + s->n_carry - keep, keep);
+        memcpy(s->carry + keep, buf, n);
+        s->n_carry = keep + n;
+    }
+}
+
+typedef struct {
+    int depth;
+    char path[];
+} ScanTask;
+
+/* Scanners and sets are indexed by worker, with one extra at the end
+   for bytes passed in directly by the janet thread. */
+struct RefScan {
+    ThreadPool *pool;
+    int nthreads;
+    Scanner *scanners;
+    FoundSet *found;
+    pthread_mutex_t lock;
+    int failed;
+    char err[PATH_MAX + 128];
+};
+
+static void scan_failf(RefScan *rs, const char *fmt, const char *path) {
+    pthread_mutex_lock(&rs->lock);
+    if (!rs->failed) {
+        rs->failed = 1;
+        snprintf(rs->err, sizeof(rs->err), fmt, path);
+    }
+    pthread_mutex_unlock(&rs->lock);
 }
 
-static void finalize_file (void *p) {
-    FILE **f = p;
-    if (*f) fclose(*f);
+static int scan_failed(RefScan *rs) {
+    pthread_mutex_lock(&rs->lock);
+    int failed = rs->failed;
+    pthread_mutex_unlock(&rs->lock);
+    return failed;
 }
 
-static void finalize_dir (void *p) {
-    DIR **d = p;
-    if (*d) closedir(*d);
+static ScanTask *new_scan_task(const char *dir, const char *name, int depth) {
+    size_t n = strlen(dir) + (name ? strlen(name) + 1 : 0) + 1;
+    ScanTask *t = xmalloc(sizeof(ScanTask) + n);
+    t->depth = depth;
+    if (name)
+        snprintf(t->path, n, "%s/%s", dir, name);
+    else
+        snprintf(t->path, n, "%s", dir);
+    return t;
 }
 
-void hash_scan_path2(JanetString store_path, const char *path, JanetTable *hashes, int rec) {
+static int scan_chunk(void *s, const uint8_t *buf, size_t n) {
+    scan_buf(s, buf, n);
+    return 0;
+}
+
+static void scan_dir(ThreadPool *pool, int worker, RefScan *rs, ScanTask *t) {
+    struct dirent *de;
+    DIR *dr = opendir(t->path);
+    if (dr == NULL) {
+        scan_failf(rs, "unable to open directory %s", t->path);
+        return;
+    }
+
+    while (1) {
+        errno = 0;
+        de = readdir(dr);
+        if (de == NULL)  {
+            if (errno != 0)
+                scan_failf(rs, "error reading directory %s", t->path);
+            break;
+        }
+        if ((strcmp(de->d_name, ".") == 0) || (strcmp(de->d_name, "..") == 0))
+            continue;
+        thread_pool_submit(pool, worker, new_scan_task(t->path, de->d_name, t->depth+1));
+    }
+    closedir(dr);
+}
+
+static void scan_task(ThreadPool *pool, int worker, void *task, void *ud) {
+    RefScan *rs = ud;
+    ScanTask *t = task;
+    Scanner *s = &rs->scanners[worker];
     struct stat statbuf;
 
-    if (rec > 1000)
-        janet_panicf("directory recursion limit reached");
+    if (scan_failed(rs))
+        goto done;
 
-    if(lstat((char *)path, &statbuf) != 0)
-        janet_panicf("unable to stat %s", path);
+    if (t->depth > MAX_SCAN_DEPTH) {
+        scan_failf(rs, "directory recursion limit reached at %s", t->path);
+        goto done;
+    }
+
+    if (lstat(t->path, &statbuf) != 0) {
+        scan_failf(rs, "unable to stat %s", t->path);
+        goto done;
+    }
 
     if (S_ISLNK(statbuf.st_mode)) {
-        char *lnkbuf = janet_smalloc(statbuf.st_size);
-        ssize_t nchars = readlink((char *)path, lnkbuf, statbuf.st_size);
+        char *lnkbuf = xmalloc(statbuf.st_size + 1);
+        ssize_t nchars = readlink(t->path, lnkbuf, statbuf.st_size + 1);
         if (nchars < 0) {
-            janet_panicf("unable to read link at %s", path);
+            scan_failf(rs, "unable to read link at %s", t->path);
+        } else {
+            reset_scanner(s);
+            scan_buf(s, (uint8_t *)lnkbuf, nchars);
         }
-        Scanner s;
-        init_scanner(&s, store_path, hashes);
-        scan_buf(&s, lnkbuf, nchars);
-        janet_sfree(lnkbuf);
+        free(lnkbuf);
     } else if (S_ISREG(statbuf.st_mode)) {
-        FILE **f = janet_smalloc(sizeof(FILE*));
-        *f = NULL;
-        janet_sfinalizer(f, finalize_file);
-        *f = fopen((char *)path, "rb");
-        if (!*f)
-            janet_panicf("unable to open %s", path);
-
-        Scanner s;
-        init_scanner(&s, store_path, hashes);
-        scan_file(&s, *f);
-        janet_sfree(f);
+        int fd = open(t->path, O_RDONLY);
+        if (fd < 0) {
+            scan_failf(rs, "unable to open %s", t->path);
+            goto done;
+        }
+        reset_scanner(s);
+        if (read_file_fd(fd, scan_chunk, s) != 0)
+            scan_failf(rs, "io error while scanning %s for package references", t->path);
+        close(fd);
     } else if (S_ISDIR(statbuf.st_mode)) {
-        struct dirent *de;
-        DIR **dr = janet_smalloc(sizeof(DIR*));
-        *dr = NULL;
-        janet_sfinalizer(dr, finalize_dir);
-        *dr = opendir(path);
-        if (*dr == NULL)
-            janet_panicf("unable to open directory %s", path);
-
-        while (1) {
-            errno = 0;
-            de = readdir(*dr);
-            if (de == NULL)  {
-                if (errno != 0)
-                    janet_panicf("error reading directory");
-                break;
+        scan_dir(pool, worker, rs, t);
+    } else {
+        scan_failf(rs, "unsupported scan file type at %s", t->path);
+    }
+
+done:
+    free(t);
+}
+
+static void ref_scan_free(RefScan *rs) {
+    if (rs->pool) {
+        thread_pool_wait(rs->pool);
+        thread_pool_free(rs->pool);
+        rs->pool = NULL;
+    }
+    for (int i = 0; i <= rs->nthreads; i++) {
+        finish_scanner(&rs->scanners[i]);
+        found_set_deinit(&rs->found[i]);
+    }
+    free(rs->scanners);
+    free(rs->found);
+    pthread_mutex_destroy(&rs->lock);
+}
+
+static void finalize_ref_scan(void *p) {
+    ref_scan_free(p);
+}
+
+/* Scratch memory, freed by ref_scan_finish or when the calling
+   cfunction panics. */
+RefScan *ref_scan_new(JanetString store_path, int nthreads) {
+    if (!find_anchor_impl)
+        find_anchor_impl = resolve_find_anchor();
+
+    RefScan *rs = janet_smalloc(sizeof(RefScan));
+    rs->failed = 0;
+    rs->err[0] = 0;
+    pthread_mutex_init(&rs->lock, NULL);
+    rs->pool = thread_pool_new(nthreads, scan_task, rs);
+    rs->nthreads = thread_pool_nthreads(rs->pool);
+    rs->scanners = xmalloc((rs->nthreads + 1) * sizeof(Scanner));
+    rs->found = xmalloc((rs->nthreads + 1) * sizeof(FoundSet));
+    for (int i = 0; i <= rs->nthreads; i++) {
+        found_set_init(&rs->found[i]);
+        init_scanner(&rs->scanners[i], store_path, janet_string_length(store_path), &rs->found[i]);
+    }
+    janet_sfinalizer(rs, finalize_ref_scan);
+    return rs;
+}
+
+/* Scan a file or directory tree in the background. */
+void ref_scan_submit_path(RefScan *rs, const char *path) {
+    thread_pool_submit(rs->pool, -1, new_scan_task(path, NULL, 0));
+}
+
+/* Start a new stream of bytes fed in with ref_scan_chunk. */
+void ref_scan_begin(RefScan *rs) {
+    reset_scanner(&rs->scanners[rs->nthreads]);
+}
+
+int ref_scan_chunk(void *rs, const uint8_t *buf, size_t n) {
+    RefScan *r = rs;
+    scan_buf(&r->scanners[r->nthreads], buf, n);
+    return 0;
+}
+
+/* Wait for background scans and add every hash found to hashes. */
+void ref_scan_finish(RefScan *rs, JanetTable *hashes) {
+    thread_pool_wait(rs->pool);
+    thread_pool_free(rs->pool);
+    rs->pool = NULL;
+
+    /* Every worker has stopped, it is safe to use janet again. */
+
+    if (!rs->failed) {
+        for (int i = 0; i <= rs->nthreads; i++) {
+            FoundSet *set = &rs->found[i];
+            for (size_t j = 0; j < set->cap; j++) {
+                uint8_t *slot = set->slots + j * HASH_SZ*2;
+                if (slot[0])
+                    janet_table_put(hashes, janet_stringv(slot, HASH_SZ*2), janet_wrap_boolean(1));
             }
-            if ((strcmp(de->d_name, ".") == 0) || (strcmp(de->d_name, "..") == 0))
-                continue;
-
-            int npath = snprintf(NULL, 0, "%s/%s", path, de->d_name) + 1;
-            char *child_path = janet_smalloc(npath+1);
-            snprintf(child_path, npath+1, "%s/%s", path, de->d_name);
-            hash_scan_path2(store_path, child_path, hashes, rec+1);
-            janet_sfree(child_path);
         }
-        janet_sfree(dr);
-    } else {
-        janet_panicf("unsupported scan file type at %s", path);
-    };
+    }
+
+    if (rs->failed) {
+        char err[sizeof(rs->err)];
+        memcpy(err, rs->err, sizeof(err));
+        janet_sfree(rs);
+        janet_panicf("%s", err);
+    }
+
+    janet_sfree(rs);
 }
 
 Janet hash_scan(int argc, Janet *argv) {
-    janet_fixarity(argc, 3);
+    janet_arity(argc, 3, 4);
     JanetString store_path = janet_getstring(argv, 0);
     Pkg *pkg = janet_getabstract(argv, 1, &pkg_type);
     if (!janet_checktype(pkg->path, JANET_STRING))
         janet_panic("package does not have a valid path");
     JanetString path = janet_unwrap_string(pkg->path);
     JanetTable *hashes = janet_gettable(argv, 2);
-    hash_scan_path2(store_path, (const char *)path, hashes, 0);
+    int nthreads = 1;
+    if (argc >= 4)
+        nthreads = janet_getinteger(argv, 3);
+    if (nthreads < 1)
+        janet_panic("expected at least one scan thread");
+    RefScan *rs = ref_scan_new(store_path, nthreads);
+    ref_scan_submit_path(rs, (const char *)path);
+    ref_scan_finish(rs, hashes);
     janet_table_put(hashes, pkg->path, janet_wrap_nil());
     return janet_wrap_table(hashes);
 }
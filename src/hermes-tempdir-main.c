@@ -7,7 +7,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <signal.h>
-#include "fts.h"
+#include "nuke.h"
 
 
 static void die(const char *msg) {
@@ -17,46 +17,8 @@ static void die(const char *msg) {
 
 static void cleanup(const char *dir)
 {
-    FTS *ftsp = NULL;
-    FTSENT *curr;
-
-    char *files[] = { (char *) dir, NULL };
-    ftsp = fts_open(files, FTS_NOCHDIR | FTS_PHYSICAL | FTS_XDEV, NULL);
-    if (!ftsp) {
-        goto finish;
-    }
-
-#define TRY(X) if(X != 0) { goto finish; }
-
-    while ((curr = fts_read(ftsp))) {
-        switch (curr->fts_info) {
-        case FTS_NS:
-        case FTS_DNR:
-        case FTS_ERR:
-            break;
-        case FTS_D:
-            TRY(chmod(curr->fts_accpath, 0700));
-            break;
-        case FTS_DP:
-            TRY(rmdir(curr->fts_accpath));
-            break;
-        case FTS_SL:
-        case FTS_SLNONE:
-            TRY(unlink(curr->fts_accpath));
-            break;
-        case FTS_F:
-        case FTS_DEFAULT:
-            TRY(chmod(curr->fts_accpath, 0700));
-            TRY(unlink(curr->fts_accpath));
-            break;
-        }
-    }
-
-#undef TRY
-
-finish:
-    if (ftsp)
-        fts_close(ftsp);
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    nuke_paths(&dir, 1, nthreads < 1 ? 1 : nthreads);
 }
 
 
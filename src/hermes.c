@@ -183,9 +183,21 @@ static const JanetReg cfuns[] = {
     {"pkg-freeze", pkg_freeze, NULL},
     {"sha256-dir-hash", sha256_dir_hash, NULL},
     {"sha256-file-hash", sha256_file_hash, NULL},
+    {"sha256-tree-hash", sha256_tree_hash, NULL},
+    {"sha256-stream", sha256_stream, NULL},
+    {"stat-fingerprint", stat_fingerprint, NULL},
+    {"sha256-self-test", jsha256_self_test, NULL},
     {"pkg-dependencies", pkg_dependencies, NULL},
     {"storify", storify, NULL},
+    {"storify-and-scan", storify_and_scan, NULL},
+    {"copy-tree", copy_tree, NULL},
+    {"tar-chunker", tar_chunker, NULL},
+    {"signify-sign", signify_sign, NULL},
+    {"signify-verify", signify_verify, NULL},
+    {"ed25519-self-test", jed25519_self_test, NULL},
     {"primitive-unpack", primitive_unpack, NULL},
+    {"archive-create", archive_create, NULL},
+    {"archive-extract", archive_extract, NULL},
     {"hash-scan", hash_scan, NULL},
     {"getgrnam", jgetgrnam, NULL},
     {"getpwnam", jgetpwnam, NULL},
@@ -200,16 +212,24 @@ static const JanetReg cfuns[] = {
     {"setegid", jsetegid, NULL},
     {"chown", jchown, NULL},
     {"exit", jexit, NULL},
+    {"fork", jfork, NULL},
+    {"waitpid", jwaitpid, NULL},
     {"chroot", jchroot, NULL},
     {"getgroups", jgetgroups, NULL},
     {"cleargroups", jcleargroups, NULL},
+    {"watch-dir", watch_dir, NULL},
     {"unix-listen", unix_listen, NULL},
     {"unix-connect", unix_connect, NULL},
     {"nuke-path", nuke_path, NULL},
+    {"nuke-paths", jnuke_paths, NULL},
     {"mount", jmount, NULL},
     {"sync", jsync, NULL},
     {"fd-set-cloexec", jfd_set_cloexec, NULL},
     {"fd-close", jfd_close, NULL},
+    {"fd-set-nonblock", jfd_set_nonblock, NULL},
+    {"fd-read", jfd_read, NULL},
+    {"fd-write", jfd_write, NULL},
+    {"poll", jpoll, NULL},
     {NULL, NULL, NULL}
 };
 
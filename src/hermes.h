@@ -1,16 +1,41 @@
 
 #define HASH_SZ 20
 #include "sha1.h"
+#include "sha256.h"
+#include "readfile.h"
+#include "fts.h"
 
 /* types */
 
+/* Open addressing map from pointers to the order they were added in. */
+typedef struct {
+    const void **keys; /* NULL marks an empty slot. */
+    int32_t *ids;
+    int32_t count;
+    int32_t cap;
+} PtrIndex;
+
+/* The stream of a function def hashed on its own, for replaying
+   into later hash states, see record_def in pkgfreeze.c. */
+typedef struct {
+    JanetBuffer *bytes;
+    JanetArray *refs;  /* start, end, lead byte and id of each back reference. */
+    JanetArray *marks; /* Values given ids, in order. */
+    JanetArray *defs;  /* Sub defs given ids, in order. */
+} DefRecording;
+
 typedef struct {
     Sha1ctx sha1_ctx;
     JanetTable seen;
     JanetTable *rreg;
-    JanetFuncEnv **seen_envs;
-    JanetFuncDef **seen_defs;
+    JanetTable *memo; /* NULL or shared between pkg-freeze calls. */
+    DefRecording *rec; /* If set the stream goes here instead of sha1_ctx. */
+    PtrIndex seen_envs;
+    PtrIndex seen_defs;
     int32_t nextid;
+    /* Bytes waiting to be fed to sha1_ctx. */
+    int32_t stagelen;
+    uint8_t stage[1024];
 } HashState;
 
 typedef struct {
@@ -49,14 +74,41 @@ Janet pkg_freeze(int32_t argc, Janet *argv);
 
 Janet sha256_dir_hash(int argc, Janet *argv);
 Janet sha256_file_hash(int argc, Janet *argv);
+Janet sha256_tree_hash(int argc, Janet *argv);
+Janet sha256_stream(int argc, Janet *argv);
+Janet stat_fingerprint(int argc, Janet *argv);
+Janet jsha256_self_test(int argc, Janet *argv);
+void sha256_dir_hash_ent(Sha256ctx *ctx, FTSENT *fent, ReadFileFn tee, void *tee_ud);
 
 /* hashscan.c */
 
+typedef struct RefScan RefScan;
+
+RefScan *ref_scan_new(JanetString store_path, int nthreads);
+void ref_scan_submit_path(RefScan *rs, const char *path);
+void ref_scan_begin(RefScan *rs);
+int ref_scan_chunk(void *rs, const uint8_t *buf, size_t n);
+void ref_scan_finish(RefScan *rs, JanetTable *hashes);
 Janet hash_scan(int32_t argc, Janet *argv);
 
 /* storify.c */
 
 Janet storify(int32_t argc, Janet *argv);
+Janet storify_and_scan(int32_t argc, Janet *argv);
+
+/* copytree.c */
+
+Janet copy_tree(int argc, Janet *argv);
+
+/* chunker.c */
+
+Janet tar_chunker(int argc, Janet *argv);
+
+/* sign.c */
+
+Janet signify_sign(int argc, Janet *argv);
+Janet signify_verify(int argc, Janet *argv);
+Janet jed25519_self_test(int argc, Janet *argv);
 
 /* deps.c */
 
@@ -70,6 +122,11 @@ void base16_encode(char *outbuf, char *inbuf, size_t in_length);
 
 Janet primitive_unpack(int argc, Janet *argv);
 
+/* archive.c */
+
+Janet archive_create(int argc, Janet *argv);
+Janet archive_extract(int argc, Janet *argv);
+
 /*  scratchvec.c */
 
 #define scratch_v_free(v)         (((v) != NULL) ? (janet_sfree(scratch_v__raw(v)), 0) : 0)
@@ -108,11 +165,19 @@ Janet jgetgrnam(int argc, Janet *argv);
 Janet jcleargroups(int argc, Janet *argv);
 Janet jchown(int argc, Janet *argv);
 Janet jexit(int argc, Janet *argv);
+Janet jfork(int argc, Janet *argv);
+Janet jwaitpid(int argc, Janet *argv);
 Janet jchroot(int argc, Janet *argv);
+Janet watch_dir(int argc, Janet *argv);
 Janet unix_listen(int argc, Janet *argv);
 Janet unix_connect(int argc, Janet *argv);
 Janet nuke_path(int argc, Janet *argv);
+Janet jnuke_paths(int argc, Janet *argv);
 Janet jmount(int argc, Janet *argv);
 Janet jsync(int argc, Janet *argv);
 Janet jfd_set_cloexec(int argc, Janet *argv);
-Janet jfd_close(int argc, Janet *argv);
\ No newline at end of file
+Janet jfd_close(int argc, Janet *argv);
+Janet jfd_set_nonblock(int argc, Janet *argv);
+Janet jfd_read(int argc, Janet *argv);
+Janet jfd_write(int argc, Janet *argv);
+Janet jpoll(int argc, Janet *argv);
\ No newline at end of file
@@ -0,0 +1,177 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "threadpool.h"
+#include "nuke.h"
+
+/* A directory being emptied. It is removed once it has been listed and
+   every subdirectory found in it has been removed, so each node counts
+   itself plus its live children. */
+typedef struct NukeDir NukeDir;
+struct NukeDir {
+    NukeDir *parent;
+    dev_t dev;
+    int pending;
+    char path[];
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    int err;
+} Nuke;
+
+static void nuke_fail(Nuke *n, int err) {
+    if (err == ENOENT)
+        return;
+    pthread_mutex_lock(&n->lock);
+    if (!n->err)
+        n->err = err;
+    pthread_mutex_unlock(&n->lock);
+}
+
+static NukeDir *nuke_dir_new(NukeDir *parent, dev_t dev, const char *path, const char *name) {
+    size_t plen = strlen(path);
+    size_t nlen = name ? strlen(name) + 1 : 0;
+    NukeDir *d = malloc(sizeof(NukeDir) + plen + nlen + 1);
+    if (!d)
+        abort();
+    d->parent = parent;
+    d->dev = dev;
+    d->pending = 1;
+    memcpy(d->path, path, plen);
+    if (name) {
+        d->path[plen] = '/';
+        memcpy(d->path + plen + 1, name, nlen - 1);
+    }
+    d->path[plen + nlen] = '\0';
+    return d;
+}
+
+/* Drop one reference to d, removing it and walking up while the
+   directories it completes become empty. */
+static void nuke_dir_release(Nuke *n, NukeDir *d) {
+    while (d) {
+        if (__atomic_sub_fetch(&d->pending, 1, __ATOMIC_ACQ_REL) != 0)
+            return;
+        if (rmdir(d->path) != 0)
+            nuke_fail(n, errno);
+        NukeDir *parent = d->parent;
+        free(d);
+        d = parent;
+    }
+}
+
+static int open_dir(const char *path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0 && errno == EACCES) {
+        if (chmod(path, 0700) != 0)
+            return -1;
+        fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    }
+    return fd;
+}
+
+static void nuke_dir_task(ThreadPool *pool, int worker, void *task, void *ud) {
+    Nuke *n = ud;
+    NukeDir *d = task;
+
+    int fd = open_dir(d->path);
+    if (fd < 0) {
+        nuke_fail(n, errno);
+        nuke_dir_release(n, d);
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        nuke_fail(n, errno);
+        close(fd);
+        nuke_dir_release(n, d);
+        return;
+    }
+    /* We need write and search permission to remove entries. */
+    if ((st.st_mode & 0700) != 0700 && fchmod(fd, 0700) != 0)
+        nuke_fail(n, errno);
+
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        nuke_fail(n, errno);
+        close(fd);
+        nuke_dir_release(n, d);
+        return;
+    }
+
+    struct dirent *ent;
+    while ((errno = 0, ent = readdir(dir))) {
+        const char *name = ent->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+
+        int is_dir = ent->d_type == DT_DIR;
+        dev_t dev = d->dev;
+        if (ent->d_type == DT_UNKNOWN || is_dir) {
+            struct stat est;
+            if (fstatat(fd, name, &est, AT_SYMLINK_NOFOLLOW) != 0) {
+                nuke_fail(n, errno);
+                continue;
+            }
+            is_dir = S_ISDIR(est.st_mode);
+            dev = est.st_dev;
+        }
+
+        if (!is_dir) {
+            if (unlinkat(fd, name, 0) != 0)
+                nuke_fail(n, errno);
+            continue;
+        }
+
+        if (dev != d->dev) {
+            /* A mount point, leave it alone, removing its parent will fail. */
+            if (unlinkat(fd, name, AT_REMOVEDIR) != 0)
+                nuke_fail(n, errno);
+            continue;
+        }
+
+        __atomic_add_fetch(&d->pending, 1, __ATOMIC_ACQ_REL);
+        thread_pool_submit(pool, worker, nuke_dir_new(d, dev, d->path, name));
+    }
+    if (errno)
+        nuke_fail(n, errno);
+
+    closedir(dir);
+    nuke_dir_release(n, d);
+}
+
+int nuke_paths(const char **paths, int npaths, int nthreads) {
+    Nuke n;
+    pthread_mutex_init(&n.lock, NULL);
+    n.err = 0;
+
+    ThreadPool *pool = thread_pool_new(nthreads, nuke_dir_task, &n);
+
+    for (int i = 0; i < npaths; i++) {
+        struct stat st;
+        if (lstat(paths[i], &st) != 0) {
+            nuke_fail(&n, errno);
+            continue;
+        }
+        if (!S_ISDIR(st.st_mode)) {
+            if (unlink(paths[i]) != 0)
+                nuke_fail(&n, errno);
+            continue;
+        }
+        thread_pool_submit(pool, -1, nuke_dir_new(NULL, st.st_dev, paths[i], NULL));
+    }
+
+    thread_pool_wait(pool);
+    thread_pool_free(pool);
+    pthread_mutex_destroy(&n.lock);
+    return n.err;
+}
@@ -0,0 +1,14 @@
+/* Parallel removal of directory trees.
+
+   Directories are listed and emptied by a thread pool using unlinkat
+   relative to the directory fd, so no path lookups are repeated per
+   entry. A directory is only chmodded when its permissions would stop
+   us listing or emptying it, files never need it. Like the fts walk this
+   replaces, we do not descend into other file systems.
+
+   None of this code touches janet. */
+
+/* Remove every path in paths with up to nthreads threads. Paths that
+   do not exist are ignored. Returns 0 or the first errno hit, removal
+   carries on past errors as far as it can. */
+int nuke_paths(const char **paths, int npaths, int nthreads);
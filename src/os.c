@@ -8,15 +8,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/mount.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include "fts.h"
+#include "nuke.h"
 
 
 
@@ -194,6 +198,43 @@ Janet jexit(int argc, Janet *argv) {
     exit(janet_getinteger(argv, 0));
 }
 
+Janet jfork(int argc, Janet *argv) {
+    (void)argv;
+    janet_fixarity(argc, 0);
+    /* Don't let the child flush our buffered output a second time. */
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0)
+        janet_panicf("unable to fork - %s", strerror(errno));
+    return janet_wrap_integer(pid);
+}
+
+// Returns [pid exit-code], a child killed by a signal gets 128+signal.
+// With nohang, returns nil if no child has exited yet.
+Janet jwaitpid(int argc, Janet *argv) {
+    janet_arity(argc, 0, 2);
+    pid_t pid = -1;
+    int flags = 0;
+    if (argc >= 1)
+        pid = janet_getinteger(argv, 0);
+    if (argc >= 2 && janet_getboolean(argv, 1))
+        flags |= WNOHANG;
+    int status;
+    pid_t r;
+    do {
+        r = waitpid(pid, &status, flags);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0)
+        janet_panicf("unable to wait for child - %s", strerror(errno));
+    if (r == 0)
+        return janet_wrap_nil();
+    int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    Janet *t = janet_tuple_begin(2);
+    t[0] = janet_wrap_integer(r);
+    t[1] = janet_wrap_integer(code);
+    return janet_wrap_tuple(janet_tuple_end(t));
+}
+
 Janet jchroot(int argc, Janet *argv) {
     janet_fixarity(argc, 1);
     if (chroot((const char*)janet_getstring(argv, 0)) != 0)
@@ -265,6 +306,155 @@ static int listen_socket_get(void *p, Janet key, Janet *out) {
     return janet_getmethod(janet_unwrap_keyword(key), listen_socket_methods, out);
 }
 
+static int dir_watch_gc(void *p, size_t len);
+static int dir_watch_get(void *p, Janet key, Janet *out);
+
+const JanetAbstractType hermes_dir_watch_type = {
+    "_hermes/dir-watch",
+    dir_watch_gc,
+    NULL,
+    dir_watch_get,
+    JANET_ATEND_GET
+};
+
+static int dir_watch_gc(void *p, size_t len) {
+    (void)len;
+    int fd = *((int*)p);
+    if (fd >= 0)
+        close(fd);
+    return 0;
+}
+
+static Janet dir_watch_close(int argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    int *pfd = janet_getabstract(argv, 0, &hermes_dir_watch_type);
+    if (*pfd >= 0)
+        close(*pfd);
+    *pfd = -1;
+    return janet_wrap_nil();
+}
+
+static double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// (:wait watch timeout &opt pids own-closes)
+//
+// Wait up to timeout seconds for something in the directory to be closed,
+// deleted or renamed, or for one of the child pids to exit. The first
+// own-closes close events are the caller's own lock attempts and releases,
+// they are drained without waking. Returns true if anything else happened.
+static Janet dir_watch_wait(int argc, Janet *argv) {
+    janet_arity(argc, 2, 4);
+    int *pfd = janet_getabstract(argv, 0, &hermes_dir_watch_type);
+    double timeout = janet_getnumber(argv, 1);
+    JanetView pids = {NULL, 0};
+    if (argc > 2 && !janet_checktype(argv[2], JANET_NIL))
+        pids = janet_getindexed(argv, 2);
+    int32_t own_closes = janet_optinteger(argv, argc, 3, 0);
+    if (*pfd < 0)
+        janet_panicf("watch closed");
+
+    struct pollfd *pfds = janet_smalloc(sizeof(struct pollfd) * (pids.len + 1));
+    pfds[0].fd = *pfd;
+    pfds[0].events = POLLIN;
+    for (int32_t i = 0; i < pids.len; i++) {
+        // Exited children stay pollable as zombies until they are reaped.
+        pfds[i + 1].fd = -1;
+#ifdef SYS_pidfd_open
+        pfds[i + 1].fd = syscall(SYS_pidfd_open, (pid_t)janet_getinteger(pids.items, i), 0);
+#endif
+        pfds[i + 1].events = POLLIN;
+        // Without pidfds we can only notice exits by polling.
+        if (pfds[i + 1].fd < 0 && (timeout < 0 || timeout > 0.25))
+            timeout = 0.25;
+    }
+
+    double deadline = monotonic_seconds() + timeout;
+    int woken = 0;
+    int _errno = 0;
+    while (!woken) {
+        int wait_ms = -1;
+        if (timeout >= 0) {
+            double remaining = deadline - monotonic_seconds();
+            if (remaining <= 0)
+                break;
+            wait_ms = (int)(remaining * 1000) + 1;
+        }
+        int r = poll(pfds, pids.len + 1, wait_ms);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            _errno = errno;
+            break;
+        }
+        if (r == 0)
+            break;
+
+        for (int32_t i = 0; i < pids.len; i++)
+            if (pfds[i + 1].revents)
+                woken = 1;
+
+        if (pfds[0].revents) {
+            char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+            ssize_t n;
+            while ((n = read(*pfd, buf, sizeof(buf))) > 0) {
+                for (char *p = buf; p < buf + n;) {
+                    struct inotify_event *ev = (struct inotify_event *)p;
+                    if ((ev->mask & IN_CLOSE) && own_closes > 0)
+                        own_closes--;
+                    else
+                        woken = 1;
+                    p += sizeof(struct inotify_event) + ev->len;
+                }
+            }
+        }
+    }
+
+    for (int32_t i = 0; i < pids.len; i++)
+        if (pfds[i + 1].fd >= 0)
+            close(pfds[i + 1].fd);
+    janet_sfree(pfds);
+    if (_errno)
+        janet_panicf("unable to poll watch - %s", strerror(_errno));
+    return janet_wrap_boolean(woken);
+}
+
+static JanetMethod dir_watch_methods[] = {
+    {"close", dir_watch_close},
+    {"wait", dir_watch_wait},
+    {NULL, NULL}
+};
+
+static int dir_watch_get(void *p, Janet key, Janet *out) {
+    (void) p;
+    if (!janet_checktype(key, JANET_KEYWORD))
+        return 0;
+    return janet_getmethod(janet_unwrap_keyword(key), dir_watch_methods, out);
+}
+
+Janet watch_dir(int argc, Janet *argv) {
+    janet_fixarity(argc, 1);
+    const char *path = (const char *)janet_getstring(argv, 0);
+
+    int *pfd = janet_abstract(&hermes_dir_watch_type, sizeof(int));
+    *pfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (*pfd < 0)
+        janet_panicf("unable to create inotify instance - %s", strerror(errno));
+
+    // Locks are released when their fd is closed, or the lock file is removed.
+    if (inotify_add_watch(*pfd, path, IN_CLOSE | IN_DELETE | IN_MOVED_TO) < 0) {
+        int _errno = errno;
+        close(*pfd);
+        *pfd = -1;
+        janet_panicf("unable to watch %s - %s", path, strerror(_errno));
+    }
+
+    return janet_wrap_abstract(pfd);
+}
+
 Janet unix_listen(int argc, Janet *argv) {
     const char *socket_path;
     struct sockaddr_un name;
@@ -338,54 +528,41 @@ Janet unix_connect(int argc, Janet *argv) {
     return janet_makefile(f, JANET_FILE_WRITE|JANET_FILE_READ|JANET_FILE_BINARY);
 }
 
+static int nuke_nthreads(int argc, Janet *argv, int n) {
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > n && !janet_checktype(argv[n], JANET_NIL))
+        nthreads = janet_getinteger(argv, n);
+    if (nthreads < 1)
+        nthreads = 1;
+    return nthreads;
+}
+
 Janet nuke_path(int argc, Janet *argv)
 {
-    janet_fixarity(argc, 1);
-    const char * dir = (const char *)janet_getstring(argv, 0);
-    int ok = 1;
-    int err = 0;
-    FTS *ftsp = NULL;
-    FTSENT *curr;
-
-    char *files[] = { (char *) dir, NULL };
-    ftsp = fts_open(files, FTS_NOCHDIR | FTS_PHYSICAL | FTS_XDEV, NULL);
-    if (!ftsp) {
-        ok = 0;
-        err = errno;
-        goto finish;
-    }
+    janet_arity(argc, 1, 2);
+    const char *path = (const char *)janet_getstring(argv, 0);
+    int err = nuke_paths(&path, 1, nuke_nthreads(argc, argv, 1));
+    if (err)
+        janet_panicf("unable to remove directory - %s", strerror(err));
+    return janet_wrap_nil();
+}
 
-#define TRY(X) if(X != 0) { ok = 0; err = errno; goto finish; }
-    while ((curr = fts_read(ftsp))) {
-        switch (curr->fts_info) {
-        case FTS_NS:
-        case FTS_DNR:
-        case FTS_ERR:
-            break;
-        case FTS_D:
-            TRY(chmod(curr->fts_accpath, 0700));
-            break;
-        case FTS_DP:
-            TRY(rmdir(curr->fts_accpath));
-            break;
-        case FTS_SL:
-        case FTS_SLNONE:
-            TRY(unlink(curr->fts_accpath));
-            break;
-        case FTS_F:
-        case FTS_DEFAULT:
-            TRY(chmod(curr->fts_accpath, 0700));
-            TRY(unlink(curr->fts_accpath));
-            break;
+Janet jnuke_paths(int argc, Janet *argv)
+{
+    janet_arity(argc, 1, 2);
+    JanetView paths = janet_getindexed(argv, 0);
+    const char **cpaths = janet_smalloc(sizeof(char *) * (paths.len ? paths.len : 1));
+    for (int32_t i = 0; i < paths.len; i++) {
+        if (!janet_checktype(paths.items[i], JANET_STRING)) {
+            janet_sfree(cpaths);
+            janet_panicf("expected string path, got %v", paths.items[i]);
         }
+        cpaths[i] = (const char *)janet_unwrap_string(paths.items[i]);
     }
-#undef TRY
-finish:
-    if (ftsp)
-        fts_close(ftsp);
-
-    if (!ok)
-        janet_panicf("unable to remove directory - %s", strerror(err));
+    int err = nuke_paths(cpaths, paths.len, nuke_nthreads(argc, argv, 1));
+    janet_sfree(cpaths);
+    if (err)
+        janet_panicf("unable to remove directories - %s", strerror(err));
     return janet_wrap_nil();
 }
 
@@ -423,3 +600,118 @@ Janet jfd_close(int argc, Janet *argv) {
       janet_panicf("unable to close fd - %s", strerror(errno));
     return janet_wrap_nil();
 }
+
+/* Raw descriptor io for event loops. Files and listen sockets may be
+   passed in place of descriptor numbers, but janet's own buffered file
+   functions must not be used on the same file. */
+
+static int getfd(const Janet *argv, int n) {
+    if (janet_checkabstract(argv[n], &janet_file_type))
+        return fileno(janet_unwrapfile(argv[n], NULL));
+    if (janet_checkabstract(argv[n], &hermes_listen_socket_type))
+        return *(int *)janet_unwrap_abstract(argv[n]);
+    return janet_getinteger(argv, n);
+}
+
+Janet jfd_set_nonblock(int argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    int fd = getfd(argv, 0);
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0)
+        janet_panicf("unable to get fd flags - %s", strerror(errno));
+    flags = janet_getboolean(argv, 1) ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    if (fcntl(fd, F_SETFL, flags) < 0)
+        janet_panicf("unable to alter fd nonblock - %s", strerror(errno));
+    return janet_wrap_nil();
+}
+
+// Read at most n bytes onto the end of buf with a single read. Returns
+// the number of bytes read, 0 at end of file, or nil if it would block.
+Janet jfd_read(int argc, Janet *argv) {
+    janet_fixarity(argc, 3);
+    int fd = getfd(argv, 0);
+    int32_t n = janet_getinteger(argv, 1);
+    JanetBuffer *buf = janet_getbuffer(argv, 2);
+    if (n < 0)
+        janet_panicf("expected a non-negative read size, got %d", n);
+    janet_buffer_extra(buf, n);
+    ssize_t r;
+    do {
+        r = read(fd, buf->data + buf->count, n);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return janet_wrap_nil();
+        janet_panicf("unable to read fd - %s", strerror(errno));
+    }
+    buf->count += r;
+    return janet_wrap_number(r);
+}
+
+// Write bytes from offset start with a single write. Returns the number
+// of bytes written, or nil if it would block. Sockets never raise SIGPIPE,
+// a closed peer is an error like any other.
+Janet jfd_write(int argc, Janet *argv) {
+    janet_arity(argc, 2, 3);
+    int fd = getfd(argv, 0);
+    JanetByteView bytes = janet_getbytes(argv, 1);
+    int32_t start = argc > 2 ? janet_getinteger(argv, 2) : 0;
+    if (start < 0 || start > bytes.len)
+        janet_panicf("write offset %d out of range", start);
+    ssize_t r;
+    do {
+        r = send(fd, bytes.bytes + start, bytes.len - start, MSG_NOSIGNAL);
+        if (r < 0 && errno == ENOTSOCK)
+            r = write(fd, bytes.bytes + start, bytes.len - start);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return janet_wrap_nil();
+        janet_panicf("unable to write fd - %s", strerror(errno));
+    }
+    return janet_wrap_number(r);
+}
+
+// (poll fds &opt timeout)
+//
+// Wait up to timeout seconds, or forever, for any of fds to be ready.
+// Each element of fds is a tuple of a descriptor and :r or :w. Returns
+// an array with true for each descriptor that is ready, closed or in error.
+Janet jpoll(int argc, Janet *argv) {
+    janet_arity(argc, 1, 2);
+    JanetView fds = janet_getindexed(argv, 0);
+    double timeout = -1;
+    if (argc > 1 && !janet_checktype(argv[1], JANET_NIL))
+        timeout = janet_getnumber(argv, 1);
+
+    struct pollfd *pfds = janet_smalloc(sizeof(struct pollfd) * (fds.len ? fds.len : 1));
+    for (int32_t i = 0; i < fds.len; i++) {
+        JanetView ent = janet_getindexed(fds.items, i);
+        if (ent.len != 2)
+            janet_panicf("expected [fd :r|:w], got %v", fds.items[i]);
+        pfds[i].fd = getfd(ent.items, 0);
+        if (janet_keyeq(ent.items[1], "r"))
+            pfds[i].events = POLLIN;
+        else if (janet_keyeq(ent.items[1], "w"))
+            pfds[i].events = POLLOUT;
+        else
+            janet_panicf("expected :r or :w, got %v", ent.items[1]);
+        pfds[i].revents = 0;
+    }
+
+    int r;
+    do {
+        r = poll(pfds, fds.len, timeout < 0 ? -1 : (int)(timeout * 1000));
+    } while (r < 0 && errno == EINTR);
+    if (r < 0) {
+        int _errno = errno;
+        janet_sfree(pfds);
+        janet_panicf("unable to poll - %s", strerror(_errno));
+    }
+
+    JanetArray *ready = janet_array(fds.len);
+    for (int32_t i = 0; i < fds.len; i++)
+        janet_array_push(ready, janet_wrap_boolean(pfds[i].revents != 0));
+    janet_sfree(pfds);
+    return janet_wrap_array(ready);
+}
@@ -49,40 +49,170 @@ static enum {
     LB_FUNCDEF_REF
 } LeadBytes;
 
+/* The stream is built from many tiny writes, stage them and
+   feed the digest in large blocks. */
+static void flush_stage(HashState *st) {
+    if (st->rec)
+        janet_buffer_push_bytes(st->rec->bytes, st->stage, st->stagelen);
+    else
+        sha1_update(&st->sha1_ctx, (char*)st->stage, st->stagelen);
+    st->stagelen = 0;
+}
+
+static uint8_t *reserve_stage(HashState *st, int32_t n) {
+    if (st->stagelen + n > (int32_t)sizeof(st->stage))
+        flush_stage(st);
+    uint8_t *out = st->stage + st->stagelen;
+    st->stagelen += n;
+    return out;
+}
+
 /* Marshal an integer onto the buffer */
 static void pushint(HashState *st, int32_t x) {
     if (x >= 0 && x < 128) {
-        uint8_t buf[1] = {(uint8_t)x};
-        sha1_update(&st->sha1_ctx, (char*)buf, 1);
+        uint8_t *out = reserve_stage(st, 1);
+        out[0] = (uint8_t)x;
     } else if (x <= 8191 && x >= -8192) {
-        uint8_t intbuf[2];
-        intbuf[0] = ((x >> 8) & 0x3F) | 0x80;
-        intbuf[1] = x & 0xFF;
-        sha1_update(&st->sha1_ctx, (char*)intbuf, 2);
+        uint8_t *out = reserve_stage(st, 2);
+        out[0] = ((x >> 8) & 0x3F) | 0x80;
+        out[1] = x & 0xFF;
     } else {
-        uint8_t intbuf[5];
-        intbuf[0] = LB_INTEGER;
-        intbuf[1] = (x >> 24) & 0xFF;
-        intbuf[2] = (x >> 16) & 0xFF;
-        intbuf[3] = (x >> 8) & 0xFF;
-        intbuf[4] = x & 0xFF;
-        sha1_update(&st->sha1_ctx, (char*)intbuf, 5);
+        uint8_t *out = reserve_stage(st, 5);
+        out[0] = LB_INTEGER;
+        out[1] = (x >> 24) & 0xFF;
+        out[2] = (x >> 16) & 0xFF;
+        out[3] = (x >> 8) & 0xFF;
+        out[4] = x & 0xFF;
     }
 }
 
 static void pushbyte(HashState *st, uint8_t b) {
-    uint8_t buf[1] = {b};
-    sha1_update(&st->sha1_ctx, (char*)buf, 1);
+    *reserve_stage(st, 1) = b;
 }
 
 static void pushbytes(HashState *st, const uint8_t *bytes, int32_t len) {
-    sha1_update(&st->sha1_ctx, (char*)bytes, len);
+    if (len > (int32_t)sizeof(st->stage)) {
+        flush_stage(st);
+        if (st->rec)
+            janet_buffer_push_bytes(st->rec->bytes, bytes, len);
+        else
+            sha1_update(&st->sha1_ctx, (char*)bytes, len);
+        return;
+    }
+    memcpy(reserve_stage(st, len), bytes, len);
+}
+
+/* Push 32 bit words little endian first. */
+static void pushwords(HashState *st, const uint32_t *words, int32_t n) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (n > 0) {
+        int32_t chunk = n < 256 ? n : 256;
+        pushbytes(st, (const uint8_t *)words, chunk * 4);
+        words += chunk;
+        n -= chunk;
+    }
+#else
+    for (int32_t i = 0; i < n; i++) {
+        uint8_t *out = reserve_stage(st, 4);
+        out[0] = words[i] & 0xFF;
+        out[1] = (words[i] >> 8) & 0xFF;
+        out[2] = (words[i] >> 16) & 0xFF;
+        out[3] = (words[i] >> 24) & 0xFF;
+    }
+#endif
+}
+
+/* Push a back reference, noting where it is when recording so the id
+   can be rebased on replay. */
+static void pushref(HashState *st, uint8_t lb, int32_t id) {
+    int32_t start = st->rec ? st->rec->bytes->count + st->stagelen : 0;
+    pushbyte(st, lb);
+    pushint(st, id);
+    if (st->rec) {
+        janet_array_push(st->rec->refs, janet_wrap_integer(start));
+        janet_array_push(st->rec->refs, janet_wrap_integer(st->rec->bytes->count + st->stagelen));
+        janet_array_push(st->rec->refs, janet_wrap_integer(lb));
+        janet_array_push(st->rec->refs, janet_wrap_integer(id));
+    }
+}
+
+static void mark_seen(HashState *st, Janet x) {
+    janet_table_put(&st->seen, x, janet_wrap_integer(st->nextid++));
+    if (st->rec)
+        janet_array_push(st->rec->marks, x);
+}
+
+/* Keys and ids share one scratch allocation, the ids follow the keys. */
+static void ptr_index_alloc(PtrIndex *idx, int32_t cap) {
+    char *mem = janet_smalloc((size_t)cap * (sizeof(void*) + sizeof(int32_t)));
+    idx->keys = (const void **)mem;
+    idx->ids = (int32_t *)(mem + (size_t)cap * sizeof(void*));
+    idx->cap = cap;
+    memset(idx->keys, 0, (size_t)cap * sizeof(void*));
+}
+
+static void ptr_index_init(PtrIndex *idx) {
+    idx->count = 0;
+    ptr_index_alloc(idx, 64);
+}
+
+static void ptr_index_deinit(PtrIndex *idx) {
+    janet_sfree(idx->keys);
+}
+
+static uint32_t ptr_index_slot(PtrIndex *idx, const void *p) {
+    uint64_t h = (uint64_t)(uintptr_t)p;
+    h ^= h >> 29;
+    h *= 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(h >> 32) & (uint32_t)(idx->cap - 1);
+}
+
+static void ptr_index_grow(PtrIndex *idx) {
+    PtrIndex old = *idx;
+    ptr_index_alloc(idx, old.cap * 2);
+    for (int32_t i = 0; i < old.cap; i++) {
+        if (!old.keys[i])
+            continue;
+        uint32_t slot = ptr_index_slot(idx, old.keys[i]);
+        while (idx->keys[slot])
+            slot = (slot + 1) & (uint32_t)(idx->cap - 1);
+        idx->keys[slot] = old.keys[i];
+        idx->ids[slot] = old.ids[i];
+    }
+    ptr_index_deinit(&old);
+}
+
+/* Returns the id of p, or -1 if it was never added. */
+static int32_t ptr_index_find(PtrIndex *idx, const void *p) {
+    uint32_t slot = ptr_index_slot(idx, p);
+    while (idx->keys[slot]) {
+        if (idx->keys[slot] == p)
+            return idx->ids[slot];
+        slot = (slot + 1) & (uint32_t)(idx->cap - 1);
+    }
+    return -1;
+}
+
+/* Returns the id of p if it was already added, otherwise adds it
+   with the next id and returns -1. */
+static int32_t ptr_index_find_or_add(PtrIndex *idx, const void *p) {
+    uint32_t slot = ptr_index_slot(idx, p);
+    while (idx->keys[slot]) {
+        if (idx->keys[slot] == p)
+            return idx->ids[slot];
+        slot = (slot + 1) & (uint32_t)(idx->cap - 1);
+    }
+    idx->keys[slot] = p;
+    idx->ids[slot] = idx->count++;
+    if (idx->count * 2 > idx->cap)
+        ptr_index_grow(idx);
+    return -1;
 }
 
 /* Forward declaration to enable mutual recursion. */
 static void hash_one(HashState *st, Janet x, int flags);
 static void hash_one_fiber(HashState *st, JanetFiber *fiber, int flags);
-static void hash_one_def(HashState *st, JanetFuncDef *def, int flags);
+static void hash_one_def(HashState *st, JanetFuncDef *def, Janet keepalive, int flags);
 static void hash_one_env(HashState *st, JanetFuncEnv *env, int flags);
 
 /* Prevent stack overflows */
@@ -91,14 +221,11 @@ static void hash_one_env(HashState *st, JanetFuncEnv *env, int flags);
 /* Hash a function env */
 static void hash_one_env(HashState *st, JanetFuncEnv *env, int flags) {
     HASH_STACKCHECK;
-    for (int32_t i = 0; i < scratch_v_count(st->seen_envs); i++) {
-        if (st->seen_envs[i] == env) {
-            pushbyte(st, LB_FUNCENV_REF);
-            pushint(st, i);
-            return;
-        }
+    int32_t ref = ptr_index_find_or_add(&st->seen_envs, env);
+    if (ref >= 0) {
+        pushref(st, LB_FUNCENV_REF, ref);
+        return;
     }
-    scratch_v_push(st->seen_envs, env);
     if (env->offset) {
         janet_panic("cannot hash closure referencing fiber stack values");
     } else {
@@ -119,19 +246,12 @@ static void janet_func_addflags(JanetFuncDef *def) {
     if (def->sourcemap) def->flags |= JANET_FUNCDEF_FLAG_HASSOURCEMAP;
 }
 
-/* Marshal a function def */
-static void hash_one_def(HashState *st, JanetFuncDef *def, int flags) {
-    HASH_STACKCHECK;
-    for (int32_t i = 0; i < scratch_v_count(st->seen_defs); i++) {
-        if (st->seen_defs[i] == def) {
-            pushbyte(st, LB_FUNCDEF_REF);
-            pushint(st, i);
-            return;
-        }
-    }
+static void init_pkg_hash_state(HashState *st, JanetTable *rreg, JanetTable *memo);
+static void deinit_pkg_hash_state(HashState *st);
+
+/* Hash the body of a function def */
+static void hash_def_body(HashState *st, JanetFuncDef *def, Janet keepalive, int flags) {
     janet_func_addflags(def);
-    /* Add to lookup */
-    scratch_v_push(st->seen_defs, def);
     pushint(st, def->flags);
     pushint(st, def->slotcount);
     pushint(st, def->arity);
@@ -151,12 +271,7 @@ static void hash_one_def(HashState *st, JanetFuncDef *def, int flags) {
         hash_one(st, def->constants[i], flags);
 
     /* hash the bytecode */
-    for (int32_t i = 0; i < def->bytecode_length; i++) {
-        pushbyte(st, def->bytecode[i] & 0xFF);
-        pushbyte(st, (def->bytecode[i] >> 8) & 0xFF);
-        pushbyte(st, (def->bytecode[i] >> 16) & 0xFF);
-        pushbyte(st, (def->bytecode[i] >> 24) & 0xFF);
-    }
+    pushwords(st, def->bytecode, def->bytecode_length);
 
     /* hash the environments if needed */
     for (int32_t i = 0; i < def->environments_length; i++)
@@ -164,7 +279,166 @@ static void hash_one_def(HashState *st, JanetFuncDef *def, int flags) {
 
     /* hash the sub funcdefs if needed */
     for (int32_t i = 0; i < def->defs_length; i++)
-        hash_one_def(st, def->defs[i], flags);
+        hash_one_def(st, def->defs[i], keepalive, flags);
+}
+
+/* A constant can be part of a standalone def digest when hashing it can
+   never give a different answer later, so no mutable values, no
+   packages which may not be frozen yet, and no functions. */
+static int constant_is_immutable(HashState *st, Janet x, int depth) {
+    if (depth > JANET_RECURSION_GUARD)
+        return 0;
+    switch (janet_type(x)) {
+    case JANET_NIL:
+    case JANET_BOOLEAN:
+    case JANET_NUMBER:
+    case JANET_STRING:
+    case JANET_SYMBOL:
+    case JANET_KEYWORD:
+        return 1;
+    default:
+        break;
+    }
+    if (st->rreg && janet_checktype(janet_table_get(st->rreg, x), JANET_SYMBOL))
+        return 1;
+    switch (janet_type(x)) {
+    case JANET_TUPLE: {
+        const Janet *tup = janet_unwrap_tuple(x);
+        for (int32_t i = 0; i < janet_tuple_length(tup); i++)
+            if (!constant_is_immutable(st, tup[i], depth + 1))
+                return 0;
+        return 1;
+    }
+    case JANET_STRUCT: {
+        const JanetKV *struct_ = janet_unwrap_struct(x);
+        for (int32_t i = 0; i < janet_struct_capacity(struct_); i++) {
+            if (janet_checktype(struct_[i].key, JANET_NIL))
+                continue;
+            if (!constant_is_immutable(st, struct_[i].key, depth + 1) ||
+                    !constant_is_immutable(st, struct_[i].value, depth + 1))
+                return 0;
+        }
+        return 1;
+    }
+    default:
+        return 0;
+    }
+}
+
+static int def_is_immutable(HashState *st, JanetFuncDef *def, int depth) {
+    if (depth > JANET_RECURSION_GUARD)
+        return 0;
+    for (int32_t i = 0; i < def->constants_length; i++)
+        if (!constant_is_immutable(st, def->constants[i], depth + 1))
+            return 0;
+    for (int32_t i = 0; i < def->defs_length; i++)
+        if (!def_is_immutable(st, def->defs[i], depth + 1))
+            return 0;
+    return 1;
+}
+
+/* Immutable defs are serialized once on their own, as if they came
+   first in a fresh stream, and the bytes are memoized across pkg-freeze
+   calls. Replaying them only needs the ids of back references rebased,
+   so the stream is exactly what hashing the def again would give. The
+   memo maps def pointers to [bytes refs marks defs keepalive], where
+   keepalive is a function holding the def so the pointer can't be
+   reused while the memo lives, or [false keepalive] for mutable defs. */
+static Janet record_def(HashState *st, JanetFuncDef *def, Janet keepalive, int flags) {
+    Janet *entry;
+    if (!def_is_immutable(st, def, 0)) {
+        entry = janet_tuple_begin(2);
+        entry[0] = janet_wrap_boolean(0);
+        entry[1] = keepalive;
+        return janet_wrap_tuple(janet_tuple_end(entry));
+    }
+
+    DefRecording rec;
+    rec.bytes = janet_buffer(0);
+    rec.refs = janet_array(0);
+    rec.marks = janet_array(0);
+    rec.defs = janet_array(0);
+    HashState sub;
+    init_pkg_hash_state(&sub, st->rreg, st->memo);
+    sub.rec = &rec;
+    ptr_index_find_or_add(&sub.seen_defs, def);
+    hash_def_body(&sub, def, keepalive, flags + 1);
+    flush_stage(&sub);
+    deinit_pkg_hash_state(&sub);
+
+    entry = janet_tuple_begin(5);
+    entry[0] = janet_stringv(rec.bytes->data, rec.bytes->count);
+    entry[1] = janet_wrap_tuple(janet_tuple_n(rec.refs->data, rec.refs->count));
+    entry[2] = janet_wrap_tuple(janet_tuple_n(rec.marks->data, rec.marks->count));
+    entry[3] = janet_wrap_tuple(janet_tuple_n(rec.defs->data, rec.defs->count));
+    entry[4] = keepalive;
+    return janet_wrap_tuple(janet_tuple_end(entry));
+}
+
+/* Push a recorded def that was just given an id, returns 0 if something
+   it refers to was already seen, which would make it a back reference. */
+static int replay_def(HashState *st, const Janet *entry) {
+    if (janet_tuple_length(entry) != 5)
+        return 0;
+    JanetString bytes = janet_unwrap_string(entry[0]);
+    const Janet *refs = janet_unwrap_tuple(entry[1]);
+    const Janet *marks = janet_unwrap_tuple(entry[2]);
+    const Janet *defs = janet_unwrap_tuple(entry[3]);
+
+    for (int32_t i = 0; i < janet_tuple_length(marks); i++)
+        if (janet_checkint(janet_table_get(&st->seen, marks[i])))
+            return 0;
+    for (int32_t i = 0; i < janet_tuple_length(defs); i++)
+        if (ptr_index_find(&st->seen_defs, janet_unwrap_pointer(defs[i])) >= 0)
+            return 0;
+
+    int32_t value_base = st->nextid;
+    int32_t def_base = st->seen_defs.count - 1;
+    int32_t pos = 0;
+    for (int32_t i = 0; i + 3 < janet_tuple_length(refs); i += 4) {
+        int32_t start = janet_unwrap_integer(refs[i]);
+        int32_t end = janet_unwrap_integer(refs[i + 1]);
+        uint8_t lb = (uint8_t)janet_unwrap_integer(refs[i + 2]);
+        int32_t id = janet_unwrap_integer(refs[i + 3]);
+        pushbytes(st, bytes + pos, start - pos);
+        pushref(st, lb, id + (lb == LB_FUNCDEF_REF ? def_base : value_base));
+        pos = end;
+    }
+    pushbytes(st, bytes + pos, janet_string_length(bytes) - pos);
+
+    for (int32_t i = 0; i < janet_tuple_length(marks); i++)
+        mark_seen(st, marks[i]);
+    for (int32_t i = 0; i < janet_tuple_length(defs); i++) {
+        ptr_index_find_or_add(&st->seen_defs, janet_unwrap_pointer(defs[i]));
+        if (st->rec)
+            janet_array_push(st->rec->defs, defs[i]);
+    }
+    return 1;
+}
+
+/* Marshal a function def */
+static void hash_one_def(HashState *st, JanetFuncDef *def, Janet keepalive, int flags) {
+    HASH_STACKCHECK;
+    int32_t ref = ptr_index_find_or_add(&st->seen_defs, def);
+    if (ref >= 0) {
+        pushref(st, LB_FUNCDEF_REF, ref);
+        return;
+    }
+    if (st->rec)
+        janet_array_push(st->rec->defs, janet_wrap_pointer(def));
+
+    if (st->memo) {
+        Janet key = janet_wrap_pointer(def);
+        Janet entry = janet_table_get(st->memo, key);
+        if (!janet_checktype(entry, JANET_TUPLE)) {
+            entry = record_def(st, def, keepalive, flags);
+            janet_table_put(st->memo, key, entry);
+        }
+        if (replay_def(st, janet_unwrap_tuple(entry)))
+            return;
+    }
+
+    hash_def_body(st, def, keepalive, flags);
 }
 
 #define JANET_FIBER_FLAG_HASCHILD (1 << 29)
@@ -210,8 +484,7 @@ static void hash_one_fiber(HashState *st, JanetFiber *fiber, int flags) {
         hash_one(st, janet_wrap_fiber(fiber->child), flags + 1);
 }
 
-#define MARK_SEEN() \
-    janet_table_put(&st->seen, x, janet_wrap_integer(st->nextid++))
+#define MARK_SEEN() mark_seen(st, x)
 
 static void hash_one_abstract(HashState *st, Janet x, int flags) {
     void *abstract = janet_unwrap_abstract(x);
@@ -265,8 +538,7 @@ static void hash_one(HashState *st, Janet x, int flags) {
     {
         Janet check = janet_table_get(&st->seen, x);
         if (janet_checkint(check)) {
-            pushbyte(st, LB_REFERENCE);
-            pushint(st, janet_unwrap_integer(check));
+            pushref(st, LB_REFERENCE, janet_unwrap_integer(check));
             return;
         }
         if (st->rreg) {
@@ -397,7 +669,7 @@ static void hash_one(HashState *st, Janet x, int flags) {
     case JANET_FUNCTION: {
         pushbyte(st, LB_FUNCTION);
         JanetFunction *func = janet_unwrap_function(x);
-        hash_one_def(st, func->def, flags);
+        hash_one_def(st, func->def, x, flags);
         /* Mark seen after reading def, but before envs */
         MARK_SEEN();
         for (int32_t i = 0; i < func->def->environments_length; i++)
@@ -418,23 +690,31 @@ static void hash_one(HashState *st, Janet x, int flags) {
 #undef MARK_SEEN
 }
 
-static void init_pkg_hash_state(HashState *st, JanetTable *rreg) {
+static void init_pkg_hash_state(HashState *st, JanetTable *rreg, JanetTable *memo) {
     sha1_init(&st->sha1_ctx);
     st->nextid = 0;
-    st->seen_defs = NULL;
-    st->seen_envs = NULL;
+    st->stagelen = 0;
+    ptr_index_init(&st->seen_defs);
+    ptr_index_init(&st->seen_envs);
     st->rreg = rreg;
+    st->memo = memo;
+    st->rec = NULL;
     janet_table_init(&st->seen, 0);
 }
 
+static void deinit_pkg_hash_state(HashState *st) {
+    janet_table_deinit(&st->seen);
+    ptr_index_deinit(&st->seen_envs);
+    ptr_index_deinit(&st->seen_defs);
+}
+
 static JanetString finalize_pkg_hash_state(HashState *st) {
     uint8_t buf[HASH_SZ];
     uint8_t hexbuf[HASH_SZ*2];
-    sha1_final(&st->sha1_ctx, &buf[0]);
+    flush_stage(st);
+    sha1_final(&st->sha1_ctx, buf);
+    deinit_pkg_hash_state(st);
     base16_encode((char*)hexbuf, (char*)buf, sizeof(buf));
-    janet_table_deinit(&st->seen);
-    scratch_v_free(st->seen_envs);
-    scratch_v_free(st->seen_defs);
     return janet_string(hexbuf, sizeof(hexbuf));
 }
 
@@ -464,7 +744,7 @@ static Janet make_pkg_path(JanetString store_path, JanetString hash, Janet name)
 }
 
 Janet pkg_freeze(int32_t argc, Janet *argv) {
-    janet_fixarity(argc, 3);
+    janet_arity(argc, 3, 4);
 
     if (!janet_checktypes(argv[0], JANET_TFLAG_STRING))
         janet_panicf("store-path must be a string, got %v", argv[0]);
@@ -475,11 +755,28 @@ Janet pkg_freeze(int32_t argc, Janet *argv) {
     if (!janet_checkabstract(argv[2], &pkg_type))
         janet_panicf("expected a pkg object, got %v", argv[2]);
 
+    JanetTable *memo = NULL;
+    if (argc >= 4 && !janet_checktype(argv[3], JANET_NIL)) {
+        if (!janet_checktypes(argv[3], JANET_TFLAG_TABLE))
+            janet_panicf("memo must be a table, got %v", argv[3]);
+        memo = janet_unwrap_table(argv[3]);
+    }
+
     JanetString store_path = janet_unwrap_string(argv[0]);
     JanetTable *rreg = janet_unwrap_table(argv[1]);
     Pkg *pkg = janet_unwrap_abstract(argv[2]);
+
+    /* Memoized defs depend on the registry they were serialized with. */
+    if (memo) {
+        Janet memo_reg = janet_table_get(memo, janet_ckeywordv("registry"));
+        if (janet_checktype(memo_reg, JANET_NIL))
+            janet_table_put(memo, janet_ckeywordv("registry"), argv[1]);
+        else if (!janet_checktype(memo_reg, JANET_TABLE) || janet_unwrap_table(memo_reg) != rreg)
+            janet_panic("freeze memo used with a different registry");
+    }
+
     HashState st;
-    init_pkg_hash_state(&st, rreg);
+    init_pkg_hash_state(&st, rreg, memo);
     hash_one(&st, pkg->name, 0);
 
     if (janet_checktype(pkg->content, JANET_NIL)) {
@@ -0,0 +1,85 @@
+#define _DEFAULT_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include "readfile.h"
+
+/* Below this, a couple of read calls are cheaper than setting up and
+   tearing down a mapping. */
+#define MMAP_THRESHOLD (256 * 1024)
+/* Map large files a window at a time to keep address space use bounded. */
+#define MMAP_WINDOW (64 * 1024 * 1024)
+#define READ_BUF_SZ (64 * 1024)
+
+static int read_file_mmap(int fd, off_t off, off_t end, ReadFileFn fn, void *ud) {
+    long page_sz = sysconf(_SC_PAGESIZE);
+
+    while (off < end) {
+        off_t map_off = off - (off % page_sz);
+        size_t skip = off - map_off;
+        size_t n = (end - off) < MMAP_WINDOW ? (end - off) : MMAP_WINDOW;
+
+        void *p = mmap(NULL, skip + n, PROT_READ, MAP_PRIVATE, fd, map_off);
+        if (p == MAP_FAILED) {
+            /* Let the read loop carry on from here. */
+            end = off;
+            break;
+        }
+        madvise(p, skip + n, MADV_SEQUENTIAL);
+        int rc = fn(ud, (uint8_t*)p + skip, n);
+        munmap(p, skip + n);
+        if (rc)
+            return rc;
+        off += n;
+    }
+
+    if (lseek(fd, end, SEEK_SET) < 0)
+        return -1;
+
+    return 0;
+}
+
+/* A mapped file truncated under us raises SIGBUS rather than a short
+   read, so only map files nobody but us can change. That is the case
+   for store contents once they have been made read only and given to
+   the store owner, build output and downloads still in flight are read
+   instead. */
+static int can_mmap(struct stat *st) {
+    return st->st_uid == geteuid() && !(st->st_mode & (S_IWUSR | S_IWGRP | S_IWOTH));
+}
+
+static int read_file_loop(int fd, ReadFileFn fn, void *ud) {
+    uint8_t buf[READ_BUF_SZ];
+
+    while (1) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            return 0;
+        int rc = fn(ud, buf, n);
+        if (rc)
+            return rc;
+    }
+}
+
+int read_file_fd(int fd, ReadFileFn fn, void *ud) {
+    struct stat st;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && can_mmap(&st)) {
+        off_t off = lseek(fd, 0, SEEK_CUR);
+        if (off >= 0 && st.st_size - off >= MMAP_THRESHOLD) {
+            int rc = read_file_mmap(fd, off, st.st_size, fn, ud);
+            if (rc)
+                return rc;
+            /* Pick up anything appended since the fstat. */
+        }
+    }
+
+    return read_file_loop(fd, fn, ud);
+}
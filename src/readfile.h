@@ -0,0 +1,14 @@
+#include <stddef.h>
+#include <inttypes.h>
+
+/* Feed the contents of a file to a callback with as few copies as we
+   can manage. Large read only files we own are mapped, everything else
+   is read with a large buffer. None of this touches janet, so it is
+   safe to call from worker threads. */
+
+typedef int (*ReadFileFn)(void *ud, const uint8_t *buf, size_t n);
+
+/* Calls fn with successive chunks of fd from its current offset until
+   end of file. Returns 0 on success, -1 with errno set on an io error,
+   or the first non zero value returned by fn. */
+int read_file_fd(int fd, ReadFileFn fn, void *ud);
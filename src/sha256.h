@@ -12,4 +12,5 @@ struct Sha256ctx {
 
 void sha256_update(Sha256ctx *ctx, uint8_t *buf, size_t len);
 void sha256_init(Sha256ctx *ctx);
-void sha256_finish(Sha256ctx *ctx, uint8_t dst[32]);
\ No newline at end of file
+void sha256_finish(Sha256ctx *ctx, uint8_t dst[32]);
+int sha256_self_test(void);
\ No newline at end of file
@@ -0,0 +1,14 @@
+#include <stddef.h>
+#include <inttypes.h>
+
+typedef struct Sha512ctx Sha512ctx;
+
+struct Sha512ctx {
+    uint8_t buf[128];
+    uint64_t count;
+    uint64_t val[8];
+};
+
+void sha512_init(Sha512ctx *ctx);
+void sha512_update(Sha512ctx *ctx, const uint8_t *buf, size_t len);
+void sha512_finish(Sha512ctx *ctx, uint8_t dst[64]);
@@ -0,0 +1,231 @@
+#define _DEFAULT_SOURCE
+#include <sys/types.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <janet.h>
+#include <errno.h>
+#include "hermes.h"
+#include "sha512.h"
+#include "ed25519.h"
+
+/* Signing and verifying messages in the format of signify -e, without
+   running hermes-signify for every message. Keys are still generated by
+   hermes-signify, so only unencrypted secret keys are supported, which
+   is all the store ever creates. */
+
+#define COMMENT_HDR "untrusted comment: "
+#define MAX_COMMENT 1024
+
+struct enckey {
+    uint8_t pkalg[2];
+    uint8_t kdfalg[2];
+    uint8_t kdfrounds[4];
+    uint8_t salt[16];
+    uint8_t checksum[8];
+    uint8_t keynum[8];
+    uint8_t seckey[64];
+};
+
+struct pubkey {
+    uint8_t pkalg[2];
+    uint8_t keynum[8];
+    uint8_t pubkey[32];
+};
+
+struct sig {
+    uint8_t pkalg[2];
+    uint8_t keynum[8];
+    uint8_t sig[64];
+};
+
+static const char b64chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void b64_encode(JanetBuffer *out, const uint8_t *b, size_t n) {
+    for (size_t i = 0; i < n; i += 3) {
+        uint32_t v = b[i] << 16;
+        if (i + 1 < n) v |= b[i+1] << 8;
+        if (i + 2 < n) v |= b[i+2];
+        janet_buffer_push_u8(out, b64chars[(v >> 18) & 63]);
+        janet_buffer_push_u8(out, b64chars[(v >> 12) & 63]);
+        janet_buffer_push_u8(out, i + 1 < n ? b64chars[(v >> 6) & 63] : '=');
+        janet_buffer_push_u8(out, i + 2 < n ? b64chars[v & 63] : '=');
+    }
+}
+
+static int b64_value(uint8_t c) {
+    const char *p = c ? strchr(b64chars, c) : NULL;
+    return p ? p - b64chars : -1;
+}
+
+/* Decode exactly n bytes from the n*4/3 rounded up chars at s. */
+static int b64_decode(uint8_t *out, size_t n, const uint8_t *s, size_t slen) {
+    if (slen != ((n + 2) / 3) * 4)
+        return -1;
+    for (size_t i = 0, o = 0; i < slen; i += 4) {
+        uint32_t v = 0;
+        for (int j = 0; j < 4; j++) {
+            int x = b64_value(s[i+j]);
+            if (x < 0) {
+                if (s[i+j] != '=' || o + j - 1 < n)
+                    return -1;
+                x = 0;
+            }
+            v = (v << 6) | x;
+        }
+        for (int j = 0; j < 3 && o < n; j++)
+            out[o++] = v >> (16 - 8 * j);
+    }
+    return 0;
+}
+
+/* Parse a comment line and base64 line into out, returning the length
+   consumed or -1. */
+static ssize_t parse_b64_file(uint8_t *out, size_t n, const uint8_t *s, size_t slen) {
+    size_t hdrlen = strlen(COMMENT_HDR);
+    if (slen < hdrlen || memcmp(s, COMMENT_HDR, hdrlen) != 0)
+        return -1;
+    const uint8_t *nl = memchr(s, '\n', slen < MAX_COMMENT ? slen : MAX_COMMENT);
+    if (!nl)
+        return -1;
+    const uint8_t *b = nl + 1;
+    const uint8_t *end = memchr(b, '\n', slen - (b - s));
+    if (!end)
+        return -1;
+    if (b64_decode(out, n, b, end - b) != 0)
+        return -1;
+    return end + 1 - s;
+}
+
+static void read_key_file(const char *path, uint8_t *out, size_t n) {
+    uint8_t buf[4096];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        janet_panicf("unable to open %s - %s", path, strerror(errno));
+    size_t len = 0;
+    while (len < sizeof(buf)) {
+        ssize_t r = read(fd, buf + len, sizeof(buf) - len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            int _errno = errno;
+            close(fd);
+            explicit_bzero(buf, sizeof(buf));
+            janet_panicf("unable to read %s - %s", path, strerror(_errno));
+        }
+        if (r == 0)
+            break;
+        len += r;
+    }
+    close(fd);
+    ssize_t used = parse_b64_file(out, n, buf, len);
+    explicit_bzero(buf, sizeof(buf));
+    if (used < 0 || (size_t)used != len)
+        janet_panicf("invalid key file %s", path);
+}
+
+/* (signify-sign sec-key-path msg)
+
+   Returns msg with an embedded signature, as hermes-signify -S -e would. */
+Janet signify_sign(int argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    const char *key_path = (const char *)janet_getstring(argv, 0);
+    JanetByteView msg = janet_getbytes(argv, 1);
+
+    struct enckey ek;
+    uint8_t digest[64];
+    Sha512ctx ctx;
+    read_key_file(key_path, (uint8_t *)&ek, sizeof(ek));
+    sha512_init(&ctx);
+    sha512_update(&ctx, ek.seckey, sizeof(ek.seckey));
+    sha512_finish(&ctx, digest);
+    int ok = memcmp(ek.pkalg, "Ed", 2) == 0
+        && memcmp(ek.kdfalg, "BK", 2) == 0
+        && memcmp(ek.kdfrounds, "\0\0\0\0", 4) == 0
+        && memcmp(ek.checksum, digest, sizeof(ek.checksum)) == 0;
+    explicit_bzero(digest, sizeof(digest));
+    if (!ok) {
+        explicit_bzero(&ek, sizeof(ek));
+        janet_panicf("unable to use %s - not an unencrypted signify secret key", key_path);
+    }
+
+    struct sig sig;
+    memcpy(sig.pkalg, "Ed", 2);
+    memcpy(sig.keynum, ek.keynum, sizeof(sig.keynum));
+    ed25519_sign(sig.sig, msg.bytes, msg.len, ek.seckey);
+    explicit_bzero(&ek, sizeof(ek));
+
+    JanetBuffer *out = janet_buffer(256 + msg.len);
+    const char *name = strrchr(key_path, '/');
+    name = name ? name + 1 : key_path;
+    size_t namelen = strlen(name);
+    if (namelen > 4 && strcmp(name + namelen - 4, ".sec") == 0) {
+        janet_buffer_push_cstring(out, COMMENT_HDR "verify with ");
+        janet_buffer_push_bytes(out, (const uint8_t *)name, namelen - 4);
+        janet_buffer_push_cstring(out, ".pub\n");
+    } else {
+        janet_buffer_push_cstring(out, COMMENT_HDR "signature from hermes\n");
+    }
+    b64_encode(out, (uint8_t *)&sig, sizeof(sig));
+    janet_buffer_push_u8(out, '\n');
+    janet_buffer_push_bytes(out, msg.bytes, msg.len);
+    return janet_wrap_buffer(out);
+}
+
+/* (signify-verify pub-key-path signed)
+
+   Returns the message embedded in signed, or nil if it was not signed
+   by the key at pub-key-path. */
+Janet signify_verify(int argc, Janet *argv) {
+    janet_fixarity(argc, 2);
+    const char *key_path = (const char *)janet_getstring(argv, 0);
+    JanetByteView signed_msg = janet_getbytes(argv, 1);
+
+    struct pubkey pk;
+    read_key_file(key_path, (uint8_t *)&pk, sizeof(pk));
+    if (memcmp(pk.pkalg, "Ed", 2) != 0)
+        janet_panicf("unable to use %s - not a signify public key", key_path);
+
+    struct sig sig;
+    ssize_t used = parse_b64_file((uint8_t *)&sig, sizeof(sig), signed_msg.bytes, signed_msg.len);
+    if (used < 0
+        || memcmp(sig.pkalg, "Ed", 2) != 0
+        || memcmp(sig.keynum, pk.keynum, sizeof(pk.keynum)) != 0)
+        return janet_wrap_nil();
+
+    const uint8_t *msg = signed_msg.bytes + used;
+    size_t len = signed_msg.len - used;
+    if (ed25519_verify(sig.sig, msg, len, pk.pubkey) != 0)
+        return janet_wrap_nil();
+    return janet_stringv(msg, len);
+}
+
+/* RFC 8032 test 2, a one byte message. */
+Janet jed25519_self_test(int argc, Janet *argv) {
+    (void)argv;
+    janet_fixarity(argc, 0);
+    static const uint8_t seed[32] = {
+        0x4c, 0xcd, 0x08, 0x9b, 0x28, 0xff, 0x96, 0xda, 0x9d, 0xb6, 0xc3, 0x46, 0xec, 0x11, 0x4e, 0x0f,
+        0x5b, 0x8a, 0x31, 0x9f, 0x35, 0xab, 0xa6, 0x24, 0xda, 0x8c, 0xf6, 0xed, 0x4f, 0xb8, 0xa6, 0xfb,
+    };
+    static const uint8_t want[64] = {
+        0x92, 0xa0, 0x09, 0xa9, 0xf0, 0xd4, 0xca, 0xb8, 0x72, 0x0e, 0x82, 0x0b, 0x5f, 0x64, 0x25, 0x40,
+        0xa2, 0xb2, 0x7b, 0x54, 0x16, 0x50, 0x3f, 0x8f, 0xb3, 0x76, 0x22, 0x23, 0xeb, 0xdb, 0x69, 0xda,
+        0x08, 0x5a, 0xc1, 0xe4, 0x3e, 0x15, 0x99, 0x6e, 0x45, 0x8f, 0x36, 0x13, 0xd0, 0xf1, 0x1d, 0x8c,
+        0x38, 0x7b, 0x2e, 0xae, 0xb4, 0x30, 0x2a, 0xee, 0xb0, 0x0d, 0x29, 0x16, 0x12, 0xbb, 0x0c, 0x00,
+    };
+    const uint8_t msg[1] = {0x72};
+    uint8_t sk[64], sig[64];
+    memcpy(sk, seed, 32);
+    ed25519_public_key(sk + 32, seed);
+    ed25519_sign(sig, msg, sizeof(msg), sk);
+    if (memcmp(sig, want, sizeof(want)) != 0)
+        janet_panic("ed25519 self test failed to sign");
+    if (ed25519_verify(sig, msg, sizeof(msg), sk + 32) != 0)
+        janet_panic("ed25519 self test failed to verify");
+    sig[0] ^= 1;
+    if (ed25519_verify(sig, msg, sizeof(msg), sk + 32) == 0)
+        janet_panic("ed25519 self test accepted a bad signature");
+    return janet_wrap_nil();
+}
@@ -20,17 +20,38 @@ static void finalize_fts(void *p) {
     if (*pfs) fts_close(*pfs);
 };
 
-Janet storify(int argc, Janet *argv) {
-    janet_fixarity(argc, 3);
-    const char *dirpath = (const char*)janet_getstring(argv, 0);
-    uid_t uid = janet_getinteger(argv, 1);
-    gid_t gid = janet_getinteger(argv, 2);
+static void storify_ent(FTSENT *fent, uid_t uid, gid_t gid) {
+    struct utimbuf t;
 
-    FTS** pfs = NULL;
-    FTSENT* fent = NULL;
-    errno = 0;
+    t.actime = 0;
+    t.modtime = 0;
+
+    switch (fent->fts_info) {
+    case FTS_F:
+    case FTS_SL:
+    case FTS_SLNONE:
+    case FTS_DEFAULT:
+    case FTS_DP:
+        if (lchown(fent->fts_accpath, uid, gid) != 0)
+            janet_panicf("unable to storify %s - lchown - %s", fent->fts_accpath, strerror(errno));
+
+        if (fent->fts_info != FTS_SL && fent->fts_info != FTS_SLNONE) {
+            if (utime(fent->fts_accpath, &t) != 0)
+                janet_panicf("unable to storify %s - utime - %s", fent->fts_accpath, strerror(errno));
+            if (chmod(fent->fts_accpath, (fent->fts_statp->st_mode&0111)|0444) != 0)
+                janet_panicf("unable to storify %s - chmod - %s", fent->fts_accpath, strerror(errno));
+        }
+        break;
+    case FTS_D:
+        /* handled above above */
+        break;
+    default:
+        janet_panicf("unsupported file at %s%s", fent->fts_path, fent->fts_name);
+    }
+}
 
-    pfs = janet_smalloc(sizeof(FTS*));
+static FTS **open_fts(const char *dirpath) {
+    FTS **pfs = janet_smalloc(sizeof(FTS*));
     *pfs = NULL;
     janet_sfinalizer(pfs, finalize_fts);
 
@@ -40,45 +61,85 @@ Janet storify(int argc, Janet *argv) {
     if (!*pfs)
         janet_panicf("unable to open directory");
 
+    return pfs;
+}
 
-    struct utimbuf t;
+static FTSENT *next_fts(FTS **pfs) {
+    errno = 0;
+    FTSENT *fent = fts_read(*pfs);
+    if (!fent && errno != 0)
+        janet_panicf("%s", strerror(errno));
+    return fent;
+}
 
-    t.actime = 0;
-    t.modtime = 0;
+Janet storify(int argc, Janet *argv) {
+    janet_fixarity(argc, 3);
+    const char *dirpath = (const char*)janet_getstring(argv, 0);
+    uid_t uid = janet_getinteger(argv, 1);
+    gid_t gid = janet_getinteger(argv, 2);
 
-    while(1) {
-        fent = fts_read(*pfs);
-        if (!fent) {
-            if (errno != 0)
-                janet_panicf("%s", strerror(errno));
-            break;
-        }
-        switch (fent->fts_info) {
-        case FTS_F:
-        case FTS_SL:
-        case FTS_SLNONE:
-        case FTS_DEFAULT:
-        case FTS_DP:
-            if (lchown(fent->fts_accpath, uid, gid) != 0)
-                janet_panicf("unable to storify %s - lchown - %s", fent->fts_accpath, strerror(errno));
-
-            if (fent->fts_info != FTS_SL && fent->fts_info != FTS_SLNONE) {
-                if (utime(fent->fts_accpath, &t) != 0)
-                    janet_panicf("unable to storify %s - utime - %s", fent->fts_accpath, strerror(errno));
-                if (chmod(fent->fts_accpath, (fent->fts_statp->st_mode&0111)|0444) != 0)
-                    janet_panicf("unable to storify %s - chmod - %s", fent->fts_accpath, strerror(errno));
-            }
-            break;
-        case FTS_D:
-            /* handled above above */
-            break;
-        default:
-            janet_panicf("unsupported file at %s%s", fent->fts_path, fent->fts_name);
-        }
-    }
+    FTS **pfs = open_fts(dirpath);
+    FTSENT *fent;
+
+    while ((fent = next_fts(pfs)))
+        storify_ent(fent, uid, gid);
 
     janet_sfree(pfs);
 
     return janet_wrap_nil();
 }
 
+/* Storify a build output, scan it for store references and optionally
+   compute its sha256 content hash, all in a single walk of the tree.
+
+   When hashing, file contents must be fed to the hasher in walk order,
+   so files are read once on this thread and teed into the scanner.
+   Otherwise the file reads are handed to the scan thread pool while
+   this thread carries on fixing up metadata. */
+Janet storify_and_scan(int argc, Janet *argv) {
+    janet_fixarity(argc, 6);
+    const char *dirpath = (const char*)janet_getstring(argv, 0);
+    uid_t uid = janet_getinteger(argv, 1);
+    gid_t gid = janet_getinteger(argv, 2);
+    JanetString store_path = janet_getstring(argv, 3);
+    int nthreads = janet_getinteger(argv, 4);
+    int want_hash = janet_getboolean(argv, 5);
+    if (nthreads < 1)
+        janet_panic("expected at least one scan thread");
+
+    RefScan *rs = ref_scan_new(store_path, want_hash ? 1 : nthreads);
+    FTS **pfs = open_fts(dirpath);
+    FTSENT *fent;
+
+    Sha256ctx ctx;
+    sha256_init(&ctx);
+
+    while ((fent = next_fts(pfs))) {
+        storify_ent(fent, uid, gid);
+        if (want_hash) {
+            if (fent->fts_info == FTS_F || fent->fts_info == FTS_SL)
+                ref_scan_begin(rs);
+            sha256_dir_hash_ent(&ctx, fent, ref_scan_chunk, rs);
+        } else if (fent->fts_info != FTS_D && fent->fts_info != FTS_DP) {
+            ref_scan_submit_path(rs, fent->fts_accpath);
+        }
+    }
+
+    janet_sfree(pfs);
+
+    JanetTable *hashes = janet_table(0);
+    ref_scan_finish(rs, hashes);
+
+    JanetTable *result = janet_table(2);
+    janet_table_put(result, janet_ckeywordv("hashes"), janet_wrap_table(hashes));
+    if (want_hash) {
+        uint8_t buf[32];
+        uint8_t hexbuf[sizeof("sha256:")-1 + sizeof(buf)*2];
+        sha256_finish(&ctx, buf);
+        memcpy(hexbuf, "sha256:", sizeof("sha256:")-1);
+        base16_encode((char*)hexbuf + sizeof("sha256:")-1, (char*)buf, sizeof(buf));
+        janet_table_put(result, janet_ckeywordv("content-hash"), janet_stringv(hexbuf, sizeof(hexbuf)));
+    }
+
+    return janet_wrap_table(result);
+}
@@ -0,0 +1,227 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "threadpool.h"
+
+typedef struct {
+    pthread_mutex_t lock;
+    void **tasks;
+    size_t head;
+    size_t tail;
+    size_t cap;
+} Deque;
+
+struct ThreadPool {
+    ThreadPoolFn fn;
+    void *ud;
+    int nthreads;
+    int ndeques;
+    Deque *deques;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t queued;      /* tasks sitting in deques, not yet claimed. */
+    size_t outstanding; /* tasks submitted but not yet finished. */
+    int stop;
+    int next_external;
+};
+
+typedef struct {
+    ThreadPool *pool;
+    int worker;
+} WorkerArg;
+
+static void *xmalloc(size_t n) {
+    void *p = malloc(n);
+    if (!p)
+        abort();
+    return p;
+}
+
+static void deque_init(Deque *d) {
+    pthread_mutex_init(&d->lock, NULL);
+    d->cap = 64;
+    d->head = 0;
+    d->tail = 0;
+    d->tasks = xmalloc(d->cap * sizeof(void*));
+}
+
+static void deque_deinit(Deque *d) {
+    pthread_mutex_destroy(&d->lock);
+    free(d->tasks);
+}
+
+static void deque_push(Deque *d, void *task) {
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+        size_t n = d->tail - d->head;
+        if (n * 2 > d->cap) {
+            d->cap *= 2;
+            void **tasks = xmalloc(d->cap * sizeof(void*));
+            memcpy(tasks, d->tasks + d->head, n * sizeof(void*));
+            free(d->tasks);
+            d->tasks = tasks;
+        } else {
+            memmove(d->tasks, d->tasks + d->head, n * sizeof(void*));
+        }
+        d->head = 0;
+        d->tail = n;
+    }
+    d->tasks[d->tail++] = task;
+    pthread_mutex_unlock(&d->lock);
+}
+
+static void *deque_pop_back(Deque *d) {
+    void *task = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->tail != d->head)
+        task = d->tasks[--d->tail];
+    pthread_mutex_unlock(&d->lock);
+    return task;
+}
+
+static void *deque_pop_front(Deque *d) {
+    void *task = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->tail != d->head)
+        task = d->tasks[d->head++];
+    pthread_mutex_unlock(&d->lock);
+    return task;
+}
+
+/* Only called after claiming one unit of pool->queued, so a task is
+   guaranteed to be somewhere, we just have to find it. */
+static void *take_task(ThreadPool *pool, int worker) {
+    while (1) {
+        void *task = deque_pop_back(&pool->deques[worker]);
+        if (task)
+            return task;
+        for (int i = 1; i < pool->nthreads; i++) {
+            task = deque_pop_front(&pool->deques[(worker + i) % pool->nthreads]);
+            if (task)
+                return task;
+        }
+    }
+}
+
+static void run_task(ThreadPool *pool, int worker) {
+    void *task = take_task(pool, worker);
+    pool->fn(pool, worker, task, pool->ud);
+    pthread_mutex_lock(&pool->lock);
+    pool->outstanding--;
+    if (pool->outstanding == 0)
+        pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *worker_main(void *p) {
+    WorkerArg *arg = p;
+    ThreadPool *pool = arg->pool;
+    int worker = arg->worker;
+    free(arg);
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->stop && pool->queued == 0)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        if (pool->stop)
+            break;
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+        run_task(pool, worker);
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+ThreadPool *thread_pool_new(int nthreads, ThreadPoolFn fn, void *ud) {
+    if (nthreads < 1)
+        nthreads = 1;
+
+    ThreadPool *pool = xmalloc(sizeof(ThreadPool));
+    pool->fn = fn;
+    pool->ud = ud;
+    pool->nthreads = nthreads;
+    pool->queued = 0;
+    pool->outstanding = 0;
+    pool->stop = 0;
+    pool->next_external = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->ndeques = nthreads;
+    pool->deques = xmalloc(nthreads * sizeof(Deque));
+    for (int i = 0; i < nthreads; i++)
+        deque_init(&pool->deques[i]);
+    pool->threads = xmalloc(nthreads * sizeof(pthread_t));
+
+    for (int i = 1; i < nthreads; i++) {
+        WorkerArg *arg = xmalloc(sizeof(WorkerArg));
+        arg->pool = pool;
+        arg->worker = i;
+        if (pthread_create(&pool->threads[i], NULL, worker_main, arg) != 0) {
+            /* Run with the threads we managed to start. */
+            free(arg);
+            pool->nthreads = i;
+            break;
+        }
+    }
+
+    return pool;
+}
+
+int thread_pool_nthreads(ThreadPool *pool) {
+    return pool->nthreads;
+}
+
+/* Submit a task, worker should be the id passed to the task function when
+   submitting from inside a task, or -1 when submitting from outside. */
+void thread_pool_submit(ThreadPool *pool, int worker, void *task) {
+    pthread_mutex_lock(&pool->lock);
+    if (worker < 0)
+        worker = pool->next_external++ % pool->nthreads;
+    pool->outstanding++;
+    pthread_mutex_unlock(&pool->lock);
+
+    deque_push(&pool->deques[worker], task);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Work as worker 0 until every submitted task has finished. */
+void thread_pool_wait(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->outstanding) {
+        if (pool->queued) {
+            pool->queued--;
+            pthread_mutex_unlock(&pool->lock);
+            run_task(pool, 0);
+            pthread_mutex_lock(&pool->lock);
+        } else {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_free(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 1; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    for (int i = 0; i < pool->ndeques; i++)
+        deque_deinit(&pool->deques[i]);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
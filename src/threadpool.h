@@ -0,0 +1,22 @@
+#include <pthread.h>
+
+/* A small work stealing thread pool.
+
+   Each worker owns a deque, tasks submitted from a worker go to
+   the back of its own deque and are popped LIFO, idle workers
+   steal from the front of other deques. The thread calling
+   thread_pool_wait acts as worker 0, so a pool of one thread
+   runs everything inline without creating any threads.
+
+   None of this code may call into janet, tasks must report
+   errors through their own state. */
+
+typedef struct ThreadPool ThreadPool;
+
+typedef void (*ThreadPoolFn)(ThreadPool *pool, int worker, void *task, void *ud);
+
+ThreadPool *thread_pool_new(int nthreads, ThreadPoolFn fn, void *ud);
+int thread_pool_nthreads(ThreadPool *pool);
+void thread_pool_submit(ThreadPool *pool, int worker, void *task);
+void thread_pool_wait(ThreadPool *pool);
+void thread_pool_free(ThreadPool *pool);
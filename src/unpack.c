@@ -3,39 +3,273 @@
 #include <archive.h>
 #include <archive_entry.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <janet.h>
+#include "threadpool.h"
 
+/* Unpacking decompresses on the calling thread and hands regular files,
+   with their contents read into memory, to a pool of writers that each
+   own an archive_write_disk. Everything else, and files too big to
+   buffer, is written in archive order on the calling thread. An entry
+   that touches a path the pool may still be writing waits for the pool
+   first. Directory permissions and times are only fixed up once every
+   file is written. */
+
+#define UNPACK_BLOCK_SIZE (1024 * 1024)
+/* Files up to this size are buffered and written by the pool. */
+#define UNPACK_MAX_FILE (16 * 1024 * 1024)
+/* Bytes of buffered files waiting for a writer before we stop reading. */
+#define UNPACK_MAX_BUFFERED (128 * 1024 * 1024)
+
+#if ARCHIVE_VERSION_NUMBER >= 3000000
+typedef int64_t unpack_off_t;
+#else
+typedef off_t unpack_off_t;
+#endif
+
+typedef struct {
+    struct archive_entry *entry;
+    char *data;
+    size_t size;
+} UnpackTask;
+
+typedef struct {
+    int flags;
+    ThreadPool *pool;
+    struct archive **exts;
+    int nexts;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t buffered;
+    /* Files queued for the pool since it was last idle, and their
+       parent directories. Only the calling thread uses these. */
+    JanetTable *pending;
+    JanetTable *pending_dirs;
+    int failed;
+    char err[1024];
+} Unpack;
+
+static void unpack_fail(Unpack *u, const char *msg) {
+    pthread_mutex_lock(&u->lock);
+    if (!u->failed) {
+        u->failed = 1;
+        snprintf(u->err, sizeof(u->err), "%s", msg ? msg : "unknown error");
+    }
+    pthread_mutex_unlock(&u->lock);
+}
+
+static int unpack_failed(Unpack *u) {
+    pthread_mutex_lock(&u->lock);
+    int failed = u->failed;
+    pthread_mutex_unlock(&u->lock);
+    return failed;
+}
+
+/* Entry names may start with ./ or end with /, compare them without. */
+static Janet entry_key(const char *path, size_t len) {
+    while (len >= 2 && path[0] == '.' && path[1] == '/') {
+        path += 2;
+        len -= 2;
+        while (len && path[0] == '/') {
+            path++;
+            len--;
+        }
+    }
+    while (len > 1 && path[len - 1] == '/')
+        len--;
+    return janet_stringv((const uint8_t *)path, len);
+}
+
+static void wait_pending(Unpack *u) {
+    thread_pool_wait(u->pool);
+    janet_table_clear(u->pending);
+    janet_table_clear(u->pending_dirs);
+}
+
+static void mark_pending(Unpack *u, const char *path) {
+    if (!path)
+        return;
+    size_t len = strlen(path);
+    janet_table_put(u->pending, entry_key(path, len), janet_wrap_boolean(1));
+    for (size_t i = len; i > 0; i--)
+        if (path[i - 1] == '/' && i > 1)
+            janet_table_put(u->pending_dirs, entry_key(path, i - 1), janet_wrap_boolean(1));
+}
+
+/* Whether writing entry could race with a file the pool is writing,
+   because it is the same path, is inside it, or replaces a directory
+   it is in. */
+static int entry_pending(Unpack *u, struct archive_entry *entry) {
+    const char *path = archive_entry_pathname(entry);
+    if (!path)
+        return u->pending->count > 0;
+    size_t len = strlen(path);
+    Janet key = entry_key(path, len);
+    if (!janet_checktype(janet_table_get(u->pending, key), JANET_NIL))
+        return 1;
+    if (archive_entry_filetype(entry) != AE_IFDIR
+        && !janet_checktype(janet_table_get(u->pending_dirs, key), JANET_NIL))
+        return 1;
+    for (size_t i = 1; i < len; i++)
+        if (path[i] == '/'
+            && !janet_checktype(janet_table_get(u->pending, entry_key(path, i)), JANET_NIL))
+            return 1;
+    return 0;
+}
+
+/* Only ask for ACLs and file flags to be restored when the entry has
+   some, so the common case skips the extra syscalls. */
+static int entry_flags(int flags, struct archive_entry *entry) {
+    unsigned long set, clear;
+    if (archive_entry_acl_count(entry, ARCHIVE_ENTRY_ACL_TYPE_POSIX1E | ARCHIVE_ENTRY_ACL_TYPE_NFS4) == 0)
+        flags &= ~ARCHIVE_EXTRACT_ACL;
+    archive_entry_fflags(entry, &set, &clear);
+    if (set == 0 && clear == 0)
+        flags &= ~ARCHIVE_EXTRACT_FFLAGS;
+    return flags;
+}
 
 static int
-copy_data(struct archive *ar, struct archive *aw)
+copy_data(Unpack *u, struct archive *ar, struct archive *aw)
 {
     int r;
     const void *buff;
     size_t size;
-#if ARCHIVE_VERSION_NUMBER >= 3000000
-    int64_t offset;
-#else
-    off_t offset;
-#endif
+    unpack_off_t offset;
 
     for (;;) {
         r = archive_read_data_block(ar, &buff, &size, &offset);
         if (r == ARCHIVE_EOF)
             return (ARCHIVE_OK);
-        if (r != ARCHIVE_OK)
+        if (r != ARCHIVE_OK) {
+            unpack_fail(u, archive_error_string(ar));
             return r;
+        }
         r = archive_write_data_block(aw, buff, size, offset);
         if (r != ARCHIVE_OK) {
-            janet_panicf("copying data failed - %s", archive_error_string(aw));
+            unpack_fail(u, archive_error_string(aw));
             return r;
         }
     }
 }
 
+/* Write an entry, with its data from ar or, if ar is NULL, from data. */
+static int write_entry(Unpack *u, struct archive *ext, struct archive_entry *entry,
+                       struct archive *ar, const char *data, size_t size) {
+    int r;
+    archive_write_disk_set_options(ext, entry_flags(u->flags, entry));
+    r = archive_write_header(ext, entry);
+    if (r < ARCHIVE_OK) {
+        fprintf(stderr, "%s\n", archive_error_string(ext));
+    } else if (archive_entry_size(entry) > 0) {
+        if (ar) {
+            if (copy_data(u, ar, ext) != ARCHIVE_OK)
+                return -1;
+        } else if (archive_write_data_block(ext, data, size, 0) != ARCHIVE_OK) {
+            unpack_fail(u, archive_error_string(ext));
+            return -1;
+        }
+    }
+    r = archive_write_finish_entry(ext);
+    if (r < ARCHIVE_OK)
+        fprintf(stderr, "%s\n", archive_error_string(ext));
+    if (r < ARCHIVE_WARN) {
+        unpack_fail(u, archive_error_string(ext));
+        return -1;
+    }
+    return 0;
+}
+
+static void unpack_task(ThreadPool *pool, int worker, void *task, void *ud) {
+    (void)pool;
+    Unpack *u = ud;
+    UnpackTask *t = task;
+    if (!unpack_failed(u))
+        write_entry(u, u->exts[worker], t->entry, NULL, t->data, t->size);
+    archive_entry_free(t->entry);
+    free(t->data);
+    pthread_mutex_lock(&u->lock);
+    u->buffered -= t->size;
+    pthread_cond_signal(&u->cond);
+    pthread_mutex_unlock(&u->lock);
+    free(t);
+}
+
+/* Read the data of the current entry into memory and queue it for the
+   pool, returns 1 if the entry was not suitable. */
+static int submit_entry(Unpack *u, struct archive *a, struct archive_entry *entry) {
+    int64_t size = archive_entry_size(entry);
+    if (thread_pool_nthreads(u->pool) < 2
+        || archive_entry_filetype(entry) != AE_IFREG
+        || archive_entry_hardlink(entry)
+        || archive_entry_sparse_count(entry) > 0
+        || size <= 0 || size > UNPACK_MAX_FILE)
+        return 1;
+
+    UnpackTask *t = malloc(sizeof(UnpackTask));
+    char *data = malloc(size);
+    struct archive_entry *clone = archive_entry_clone(entry);
+    if (!t || !data || !clone) {
+        free(t);
+        free(data);
+        if (clone)
+            archive_entry_free(clone);
+        unpack_fail(u, "out of memory");
+        return -1;
+    }
+
+    size_t filled = 0;
+    for (;;) {
+        const void *buff;
+        size_t n;
+        unpack_off_t offset;
+        int r = archive_read_data_block(a, &buff, &n, &offset);
+        if (r == ARCHIVE_EOF)
+            break;
+        if (r != ARCHIVE_OK || offset < 0 || (uint64_t)offset + n > (uint64_t)size) {
+            unpack_fail(u, r != ARCHIVE_OK ? archive_error_string(a) : "archive entry data exceeds its size");
+            free(t);
+            free(data);
+            archive_entry_free(clone);
+            return -1;
+        }
+        if ((size_t)offset > filled)
+            memset(data + filled, 0, offset - filled);
+        memcpy(data + offset, buff, n);
+        if (offset + n > filled)
+            filled = offset + n;
+    }
+    t->entry = clone;
+    t->data = data;
+    t->size = filled;
+
+    pthread_mutex_lock(&u->lock);
+    while (u->buffered && u->buffered + t->size > UNPACK_MAX_BUFFERED)
+        pthread_cond_wait(&u->cond, &u->lock);
+    u->buffered += t->size;
+    pthread_mutex_unlock(&u->lock);
+
+    thread_pool_submit(u->pool, -1, t);
+    return 0;
+}
+
+static void finalize_unpack(void *p) {
+    Unpack *u = p;
+    thread_pool_wait(u->pool);
+    thread_pool_free(u->pool);
+    for (int i = 0; i < u->nexts && u->exts[i]; i++) {
+        archive_write_close(u->exts[i]);
+        archive_write_free(u->exts[i]);
+    }
+    free(u->exts);
+    pthread_mutex_destroy(&u->lock);
+    pthread_cond_destroy(&u->cond);
+}
+
 static void finalize_read(void *p) {
     struct archive **pa = p;
     archive_read_close(*pa);
@@ -48,6 +282,29 @@ static void finalize_write(void *p) {
     archive_write_free(*pa);
 };
 
+static struct archive *new_disk_writer(int flags) {
+    struct archive *ext = archive_write_disk_new();
+    if (!ext)
+        janet_panic("out of memory");
+    archive_write_disk_set_options(ext, flags);
+    archive_write_disk_set_standard_lookup(ext);
+    return ext;
+}
+
+static void unpack_panic(Unpack *u) {
+    char err[sizeof(u->err)];
+    /* Writers work relative to the current directory, which the caller
+       may change back as soon as we return. */
+    thread_pool_wait(u->pool);
+    memcpy(err, u->err, sizeof(err));
+    janet_sfree(u);
+    janet_panicf("unpack failed - %s", err);
+}
+
+/* (primitive-unpack archive &opt nthreads)
+
+   Unpack archive into the current directory, writing files on
+   nthreads threads, one per cpu by default. */
 Janet primitive_unpack(int argc, Janet *argv)
 {
     struct archive **pa;
@@ -63,8 +320,13 @@ Janet primitive_unpack(int argc, Janet *argv)
     flags |= ARCHIVE_EXTRACT_ACL;
     flags |= ARCHIVE_EXTRACT_FFLAGS;
 
-    janet_fixarity(argc, 1);
+    janet_arity(argc, 1, 2);
     const char *filename = (const char*)janet_getstring(argv, 0);
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 1)
+        nthreads = janet_getinteger(argv, 1);
+    if (nthreads < 1)
+        nthreads = 1;
 
     pa = janet_smalloc(sizeof(struct archive *));
     pext = janet_smalloc(sizeof(struct archive *));
@@ -77,42 +339,65 @@ Janet primitive_unpack(int argc, Janet *argv)
     archive_read_support_format_all(a);
     archive_read_support_filter_all(a);
 
-    *pext = archive_write_disk_new();
+    /* Finalized before the pool, so directories are fixed up last. */
+    *pext = new_disk_writer(flags);
     janet_sfinalizer(pext, finalize_write);
     ext = *pext;
-    archive_write_disk_set_options(ext, flags);
-    archive_write_disk_set_standard_lookup(ext);
-#define FAIL janet_panic("unpack failed")
-    if ((r = archive_read_open_filename(a, filename, 10240)))
-        FAIL;
+
+    Unpack *u = janet_smalloc(sizeof(Unpack));
+    u->flags = flags;
+    u->buffered = 0;
+    u->pending = janet_table(0);
+    u->pending_dirs = janet_table(0);
+    u->failed = 0;
+    u->err[0] = '\0';
+    pthread_mutex_init(&u->lock, NULL);
+    pthread_cond_init(&u->cond, NULL);
+    u->pool = thread_pool_new(nthreads, unpack_task, u);
+    u->nexts = thread_pool_nthreads(u->pool);
+    u->exts = calloc(u->nexts, sizeof(struct archive *));
+    if (!u->exts)
+        u->nexts = 0;
+    janet_sfinalizer(u, finalize_unpack);
+    if (!u->exts)
+        janet_panic("out of memory");
+    for (int i = 0; i < u->nexts; i++)
+        u->exts[i] = new_disk_writer(flags);
+
+    if (archive_read_open_filename(a, filename, UNPACK_BLOCK_SIZE) != ARCHIVE_OK) {
+        unpack_fail(u, archive_error_string(a));
+        unpack_panic(u);
+    }
     for (;;) {
         r = archive_read_next_header(a, &entry);
         if (r == ARCHIVE_EOF)
             break;
         if (r < ARCHIVE_OK)
             fprintf(stderr, "%s\n", archive_error_string(a));
-        if (r < ARCHIVE_WARN)
-            FAIL;
-        r = archive_write_header(ext, entry);
-        if (r < ARCHIVE_OK)
-            fprintf(stderr, "%s\n", archive_error_string(ext));
-        else if (r < ARCHIVE_WARN) {
-            FAIL;
-        } else if (archive_entry_size(entry) > 0) {
-            r = copy_data(a, ext);
-            if (r < ARCHIVE_OK)
-                fprintf(stderr, "%s\n", archive_error_string(ext));
-            if (r < ARCHIVE_WARN)
-                FAIL;
+        if (r < ARCHIVE_WARN) {
+            unpack_fail(u, archive_error_string(a));
+            break;
         }
-        r = archive_write_finish_entry(ext);
-        if (r < ARCHIVE_OK)
-            fprintf(stderr, "%s\n", archive_error_string(ext));
-        if (r < ARCHIVE_WARN)
-            FAIL;
+        /* A hard link may point at a file the pool is still writing. */
+        if (entry_pending(u, entry) || archive_entry_hardlink(entry))
+            wait_pending(u);
+        r = submit_entry(u, a, entry);
+        if (r < 0)
+            break;
+        if (r == 0) {
+            mark_pending(u, archive_entry_pathname(entry));
+            continue;
+        }
+        if (write_entry(u, ext, entry, a, NULL, 0) != 0)
+            break;
+        if (unpack_failed(u))
+            break;
     }
-#undef FAIL
+    thread_pool_wait(u->pool);
+    if (u->failed)
+        unpack_panic(u);
+    janet_sfree(u);
     janet_sfree(pa);
     janet_sfree(pext);
     return janet_wrap_nil();
-}
\ No newline at end of file
+}